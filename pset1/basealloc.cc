@@ -1,86 +1,149 @@
 #define M61_DISABLE 1
 #include "m61.hh"
-#include <unordered_map>
-#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <cstddef>
 #include <sys/mman.h>
+#if M61_PRELOAD
+// in libm61.so, malloc() and free() are m61's; use the C library's own
+extern "C" void* __libc_malloc(size_t sz);
+extern "C" void __libc_free(void* ptr);
+#define malloc(sz) __libc_malloc((sz))
+#define free(ptr) __libc_free((ptr))
+#endif
 
 
 // This file contains a base memory allocator guaranteed not to
 // overwrite freed allocations. No need to understand it.
 
+// Every block starts with a `base_header` recording its capacity. Freed
+// blocks wait in bins of similar capacity, oldest first, and are reused
+// only after `base_delay` more frees, so freed memory is never handed
+// out (and overwritten) right away. An allocation takes the oldest ripe
+// block from the first bins that fit, with no hashing or probing.
 
-using base_allocation = std::pair<uintptr_t, size_t>;
+struct base_header {
+    size_t capacity;        // usable bytes after the header
+    uintptr_t magic;        // base_live or base_freed, xor header address
+    base_header* next;      // next block in its bin once freed
+    uint64_t epoch;         // value of `nfrees` when freed
+};
+static_assert(sizeof(base_header) % alignof(std::max_align_t) == 0,
+              "base_header must preserve max_align_t alignment");
 
-// `allocs` is a hash table mapping active pointer address to allocation size.
-// `frees` is a vector of freed allocations.
-static std::unordered_map<uintptr_t, size_t> allocs;
-static std::vector<base_allocation> frees;
+struct base_bin {
+    base_header* head;      // oldest freed block
+    base_header* tail;      // newest freed block
+};
+
+// Bins are spaced eight per power of two: bin (k - 2) * 8 + i holds
+// capacities in [(8 + i) << (k - 3), (9 + i) << (k - 3)), and bins 0-7
+// hold capacities 0-7. A block reused from within an octave of its
+// request wastes less than half its capacity.
+static const unsigned base_nbins = 512;
+static const uint64_t base_delay = 64;
+static const uintptr_t base_live = 0x6261736c69766521;
+static const uintptr_t base_freed = 0x6261736672656564;
+
+static base_bin bins[base_nbins];
+static uint64_t nfrees;
 static int disabled;
+// `nested` is set while this thread is inside the base allocator;
+// `lock` protects `bins` and `nfrees` against other threads.
+static thread_local int nested;
+static std::mutex lock;
+
+static void base_allocator_atexit();
 
-static unsigned alloc_random() {
-    static uint64_t x = 8973443640547502487ULL;
-    x = x * 6364136223846793005ULL + 1ULL;
-    return x >> 32;
+static unsigned base_bin_of(size_t sz) {
+    if (sz < 8) {
+        return sz;
+    }
+    unsigned k = 63 - __builtin_clzll(sz);
+    return (k - 2) * 8 + ((sz >> (k - 3)) & 7);
 }
 
-static void base_allocator_atexit();
+// Remove and return the oldest block of bin `b` if it has at least `sz`
+// bytes and was freed at least `base_delay` frees ago.
+static base_header* base_bin_take(unsigned b, size_t sz) {
+    base_header* h = bins[b].head;
+    if (!h || h->capacity < sz || nfrees - h->epoch < base_delay) {
+        return nullptr;
+    }
+    bins[b].head = h->next;
+    if (!bins[b].head) {
+        bins[b].tail = nullptr;
+    }
+    return h;
+}
 
 void* base_malloc(size_t sz) {
-    if (disabled) {
-        return malloc(sz);
+    if (sz > SIZE_MAX - sizeof(base_header)) {
+        return nullptr;
     }
-    ++disabled;
-    uintptr_t ptr = 0;
+    base_header* h = nullptr;
+    if (!disabled && !nested) {
+        ++nested;
+        std::lock_guard<std::mutex> guard(lock);
+        static int base_alloc_atexit_installed = 0;
+        if (!base_alloc_atexit_installed) {
+            atexit(base_allocator_atexit);
+            base_alloc_atexit_installed = 1;
+        }
 
-    static int base_alloc_atexit_installed = 0;
-    if (!base_alloc_atexit_installed) {
-        atexit(base_allocator_atexit);
-        base_alloc_atexit_installed = 1;
+        // try the bin holding `sz` itself, then the next octave of bins,
+        // whose blocks are all big enough
+        unsigned b = base_bin_of(sz);
+        h = base_bin_take(b, sz);
+        unsigned end = std::min(b + 9, base_nbins);
+        for (++b; !h && b < end; ++b) {
+            h = base_bin_take(b, sz);
+        }
+        --nested;
     }
 
-    // try to use a previously-freed block 75% of the time
-    unsigned r = alloc_random();
-    if (r % 4 != 0) {
-        for (unsigned ntries = 0; ntries < 10 && ntries < frees.size(); ++ntries) {
-            auto& f = frees[alloc_random() % frees.size()];
-            if (f.second >= sz) {
-                allocs.insert(f);
-                ptr = f.first;
-                f = frees.back();
-                frees.pop_back();
-                break;
-            }
+    if (!h) {
+        // need a new allocation
+        h = reinterpret_cast<base_header*>(malloc(sizeof(base_header) + sz));
+        if (!h) {
+            return nullptr;
         }
+        h->capacity = sz;
     }
+    h->magic = base_live ^ reinterpret_cast<uintptr_t>(h);
+    return h + 1;
+}
 
+void base_free(void* ptr) {
     if (!ptr) {
-        // need a new allocation
-        ptr = reinterpret_cast<uintptr_t>(malloc(sz ? sz : 1));
+        return;
     }
-    if (ptr) {
-        allocs[reinterpret_cast<uintptr_t>(ptr)] = sz;
+    base_header* h = reinterpret_cast<base_header*>(ptr) - 1;
+    if (h->magic != (base_live ^ reinterpret_cast<uintptr_t>(h))) {
+        // complain about invalid free
+        fprintf(stderr, "ERROR: invalid free of %p at %p", ptr,
+                __builtin_extract_return_addr(__builtin_return_address(0)));
+        return;
+    }
+    h->magic = base_freed ^ reinterpret_cast<uintptr_t>(h);
+    if (disabled || nested) {
+        free(h);
+        return;
     }
 
-    --disabled;
-    return reinterpret_cast<void*>(ptr);
-}
-
-void base_free(void* ptr) {
-    if (disabled || !ptr) {
-        free(ptr);
+    // queue the block at the back of its bin
+    ++nested;
+    std::lock_guard<std::mutex> guard(lock);
+    base_bin& bin = bins[base_bin_of(h->capacity)];
+    h->next = nullptr;
+    h->epoch = nfrees++;
+    if (bin.tail) {
+        bin.tail->next = h;
     } else {
-        // mark free if found; if not found, complain about invalid free
-        ++disabled;
-        auto it = allocs.find(reinterpret_cast<uintptr_t>(ptr));
-        if (it != allocs.end()) {
-            frees.push_back(*it);
-            allocs.erase(it);
-        } else {
-            fprintf(stderr, "ERROR: invalid free of %p at %p", ptr,
-                    __builtin_extract_return_addr(__builtin_return_address(0)));
-        }
-        --disabled;
+        bin.head = h;
     }
+    bin.tail = h;
+    --nested;
 }
 
 void base_allocator_disable(bool d) {
@@ -89,7 +152,11 @@ void base_allocator_disable(bool d) {
 
 static void base_allocator_atexit() {
     // clean up freed memory to shut up leak detector
-    for (auto& alloc : frees) {
-        free(reinterpret_cast<void*>(alloc.first));
+    for (auto& bin : bins) {
+        while (base_header* h = bin.head) {
+            bin.head = h->next;
+            free(h);
+        }
+        bin.tail = nullptr;
     }
 }
@@ -0,0 +1,61 @@
+#! /usr/bin/perl -w
+# check-sampling.pl
+#    Run hhtest exactly and with M61_SAMPLE_RATE at several rates, and
+#    check that every sampled run reports the same heaviest hitter and the
+#    same top three heavy hitters as the exact run. Configurations marked
+#    to also check counts compare the most frequent allocators the same way.
+use strict;
+
+my($Red, $Green, $Off) = ("\x1b[01;31m", "\x1b[01;32m", "\x1b[0m");
+$Red = $Green = $Off = "" if !-t STDOUT;
+
+# hhtest arguments, sampling rates (mean bytes per sample) suited to the
+# number of bytes those arguments allocate, and whether to check counts.
+# at rate 12000 a 12000-byte sample stands for about 1.58 allocations and
+# a 14000-byte one for 1.45, so rounding each sample's count to the
+# nearest integer would reorder the most frequent allocators
+my(@configs) = (
+    ["0 1000000", [1024, 16384, 262144], 0],
+    ["1 1000000", [16, 64, 256], 0],
+    ["0.5 500000 -0.5 500000", [1024, 16384, 262144], 0],
+    ["-0.1 1000000", [12000], 1]
+);
+
+sub heavy_hitters ($$$) {
+    my($rate, $args, $report) = @_;
+    local $ENV{"M61_SAMPLE_RATE"} = $rate;
+    my(@sites);
+    open(my $fh, "-|", "./hhtest $args") or die "./hhtest: $!\n";
+    while (defined($_ = <$fh>)) {
+        push @sites, $1 if /^$report: (\S+): /;
+    }
+    close($fh) or die "./hhtest $args failed\n";
+    return @sites;
+}
+
+sub top3 (@) {
+    my(@sites) = @_;
+    return join(" ", sort(grep { defined($_) } @sites[0..2]));
+}
+
+my($good) = 1;
+foreach my $config (@configs) {
+    my($args, $rates, $counts) = @$config;
+    foreach my $report ("HEAVY HITTER", $counts ? ("FREQUENTLY ALLOCATED") : ()) {
+        my(@exact) = heavy_hitters(0, $args, $report);
+        my($what) = $report eq "HEAVY HITTER" ? "" : " counts";
+        foreach my $rate (@$rates) {
+            my(@sampled) = heavy_hitters($rate, $args, $report);
+            if (@sampled && $sampled[0] eq $exact[0]
+                && top3(@sampled) eq top3(@exact)) {
+                print "${Green}hhtest $args, rate $rate$what OK${Off}\n";
+            } else {
+                print "${Red}hhtest $args, rate $rate$what FAIL${Off}\n",
+                    "  expected top hitters ", top3(@exact), " (heaviest $exact[0])\n",
+                    "  got ", top3(@sampled), " (heaviest ", ($sampled[0] // "none"), ")\n";
+                $good = 0;
+            }
+        }
+    }
+}
+exit($good ? 0 : 1);
@@ -1,339 +1,3416 @@
 #define M61_DISABLE 1
 #include "m61.hh"
+#include "m61trace.hh"
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
 #include <cinttypes>
 #include <cassert>
-#include <unordered_map>
+#include <cstddef>
+#include <cstdarg>
+#include <cerrno>
+#include <string>
+#include <map>
+#include <deque>
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <csignal>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-// allocation metadata struct
-struct allocation_m
+// spinlock
+// lock for the short critical sections on the allocation path; cheaper
+// than std::mutex when uncontended and usable with std::lock_guard
+struct m61_spinlock
+{
+    std::atomic<bool> locked{false};
+
+    void lock()
+    {
+        while (locked.exchange(true, std::memory_order_acquire))
+        {
+            while (locked.load(std::memory_order_relaxed))
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                _mm_pause();
+#else
+                std::this_thread::yield();
+#endif
+            }
+        }
+    }
+    void unlock()
+    {
+        locked.store(false, std::memory_order_release);
+    }
+};
+
+// allocation header
+// placed immediately before every user pointer, so looking up a block's
+// metadata is a subtraction rather than a hash table lookup
+struct m61_header
 {
     size_t sz; // size of allocation
-    bool freed; // true if allocation has been freed
-    const char* file; // file from which allocation was called
-    long line; // line from which allocation was called
+    unsigned site; // call site that allocated it
+    unsigned short cls; // slab size class, cls_base or cls_mmap
+    unsigned short flags; // hdr_sampled if tracked in the active list, hdr_resized
+    unsigned stack; // call stack that allocated it, or 0
+    unsigned pad; // bytes before the region of an over-aligned cls_base block
+    m61_header* prev; // previous block in active list; magazine link once freed
+    m61_header* next; // next block in active list; free list link once freed
+    uintptr_t canary; // hdr_live or hdr_freed xor address of header
+};
+
+// keep user pointers aligned for any type
+static_assert(sizeof(m61_header) % alignof(std::max_align_t) == 0,
+              "m61_header must preserve max_align_t alignment");
+
+// slab
+// page-multiple chunk from base_malloc carved into equal slots of one size
+// class; the slot area starts right after this header
+struct m61_slab
+{
+    m61_slab* next; // next slab in slab list
+    unsigned cls; // size class of every slot in this slab
+} __attribute__((aligned(16)));
+
+// per-class depot
+// shared pool behind the per-thread caches; holds full magazines (chains
+// of mag_size freed blocks linked through `next`, chained to each other
+// through the first block's `prev`), loose freed blocks, and the bump
+// region of the newest slab
+struct alignas(64) m61_depot
+{
+    std::mutex lock;
+    m61_header* mags; // full magazines
+    m61_header* loose; // freed blocks flushed by exiting threads
+    char* bump; // next never-used slot in the newest slab
+    char* bump_end; // end of the usable slots in the newest slab
+};
+
+// region
+// an entry in the address index: a slab, cut into `stride`-byte slots
+// that each start with a header, or a single large block (stride 0)
+struct m61_region
+{
+    size_t size; // bytes from the region's start
+    size_t stride; // slot size, or 0 for a large block
+};
+
+// per-thread cache of freed blocks for one size class
+struct m61_tcache_bin
+{
+    m61_header* head; // freed blocks, linked through `next`
+    unsigned count; // number of blocks in the list
+};
+
+// immortal object
+// static storage for a T that is constructed but never destroyed, so m61
+// keeps working in exit-time code that runs after static destructors,
+// such as libm61.so's report
+template <typename T>
+union m61_immortal
+{
+    T value;
+    m61_immortal() : value() {}
+    ~m61_immortal() {}
+};
+
+// active list shard
+// live blocks are spread over several locked lists by header address so
+// threads rarely contend on the same lock
+struct alignas(64) m61_active_shard
+{
+    m61_spinlock lock;
+    m61_header* head;
 };
 
-struct hh_call_meta
+// call sites
+// every (file, line) that allocates is interned into a dense site id, so
+// headers and histories store 4 bytes instead of a pointer and a line,
+// and per-site counters are flat arrays indexed by id. sites are stored
+// in chunks that never move, so an id resolves without locking; new
+// sites are found through an open-addressing index under `site_lock`,
+// behind a small direct-mapped cache in each thread. site 0 is "?":0,
+// which also stands for any site past site_max
+struct m61_site
 {
     const char* file; // file from which allocation was called
     long line; // line from which allocation was called
+};
 
-    bool operator==(const hh_call_meta &b) const
-    {
-        return file == b.file && line == b.line;
-    }
+const unsigned id_chunk_bits = 12; // ids per chunk, of sites or stacks: 4096
+const unsigned site_nchunks = 256;
+const unsigned site_max = site_nchunks << id_chunk_bits;
+const unsigned site_ncache = 64; // per-thread cache entries, a power of 2
+
+struct m61_site_cache
+{
+    const char* file;
+    long line;
+    unsigned site;
 };
 
-struct hh_call_meta_hasher
+// stack traces
+// with M61_STACK_DEPTH=N in the environment (at most stack_max_depth),
+// each sampled allocation also records up to N return addresses, found by
+// walking frame pointers up from m61_malloc, so frames built without them
+// cut traces short. stacks are interned like sites, deduplicated by site
+// and addresses; stack 0 is the empty stack
+struct m61_stack
 {
-    size_t operator() (const hh_call_meta &key) const
-    {
-        // ghetto hash function pulled off https://gist.github.com/beyondwdq/7245893
-        return ((uintptr_t) key.file << sizeof(uintptr_t) | key.line);
-    }
+    uint64_t hash;
+    unsigned site; // call site that captured it
+    unsigned depth;
+    const uintptr_t* pcs; // return addresses, innermost first
+};
+
+const unsigned stack_max_depth = 32;
+const unsigned stack_nchunks = 64;
+const unsigned stack_max = stack_nchunks << id_chunk_bits;
+const unsigned stack_ncache = 64; // per-thread cache entries, a power of 2
+
+// per-site or per-stack heavy hitter counters, written like m61_counters.
+// the live counters of sites (not stacks) track sampled blocks not yet
+// freed, for heap snapshots; like nactive, they may wrap below 0 in a
+// thread that frees blocks others allocated
+struct m61_hh_counts
+{
+    std::atomic<unsigned long long> bytes; // estimated bytes allocated
+    std::atomic<unsigned long long> count; // estimated number of allocations
+    std::atomic<unsigned long long> live_bytes; // estimated bytes not yet freed
+    std::atomic<unsigned long long> live_count; // estimated blocks not yet freed
+};
+
+// slab front end
+// blocks whose size plus terminator fit in slab_classes[i] are carved from
+// slabs of that class and recycled through per-thread caches backed by a
+// per-class depot; larger blocks go to base_malloc or their own mapping
+const size_t slab_classes[] = {16, 32, 64, 128, 256, 512, 1024, 2048};
+const unsigned nclasses = sizeof(slab_classes) / sizeof(slab_classes[0]);
+const size_t slab_size = 64 << 10;
+// slabs each thread remembers as mapped, indexed by address / slab_size
+const unsigned slab_nseen = 64;
+// blocks moved between a thread cache and the depot at once; a thread
+// cache holds fewer than 2 * mag_size blocks per class
+const unsigned mag_size = 32;
+// classes of blocks too large for a slab
+const unsigned short cls_base = nclasses; // from base_malloc
+const unsigned short cls_mmap = nclasses + 1; // mapped by mmap_alloc
+// slot strides, set at startup: the slot data of every class is aligned
+// to slab_align, which M61_CACHE_ALIGN=1 raises to a cache line so hot
+// blocks neither straddle lines nor share them with a neighbor's header
+const size_t cache_line = 64;
+size_t slab_align = alignof(std::max_align_t);
+size_t slab_stride[nclasses];
+
+// active blocks of one size class (slab classes, cls_base, cls_mmap)
+struct m61_class_counters
+{
+    std::atomic<unsigned long long> nactive;
+    std::atomic<unsigned long long> active_size; // bytes requested
+    std::atomic<unsigned long long> reserved_size; // bytes set aside, see block_reserved
+};
+
+// per-thread statistics
+// written only by the owning thread (so no read-modify-write is needed)
+// and read by m61_get_statistics; counts may wrap below 0 when blocks are
+// freed by a thread other than the one that allocated them
+struct m61_counters
+{
+    std::atomic<unsigned long long> nactive;
+    std::atomic<unsigned long long> active_size;
+    std::atomic<unsigned long long> ntotal;
+    std::atomic<unsigned long long> total_size;
+    std::atomic<unsigned long long> nfail;
+    std::atomic<unsigned long long> fail_size;
+    std::atomic<unsigned long long> nrealloc;
+    std::atomic<unsigned long long> nrealloc_inplace;
+    m61_class_counters classes[nclasses + 2];
+};
+
+// latency instrumentation
+// with M61_LATENCY_SAMPLE=N in the environment, every Nth operation of
+// each thread is timed (with rdtsc where available) and its latency added
+// to a histogram whose bucket i holds latencies in [2^i, 2^(i+1)) ticks.
+// lat_backend is the part of timed operations spent outside the thread
+// cache: in the depot, base_malloc/base_free, or mapping large blocks.
+// allocations are counted by size class whether or not N is set
+enum lat_op
+{
+    lat_malloc, lat_free, lat_realloc, lat_backend, lat_nops
+};
+const char* const lat_op_names[lat_nops] = {"malloc", "free", "realloc", "backend"};
+const unsigned lat_nbuckets = 48;
+
+// per-thread latency histograms, written like m61_counters
+struct m61_latency
+{
+    std::atomic<unsigned long long> hist[lat_nops][lat_nbuckets];
+    std::atomic<unsigned long long> ticks[lat_nops]; // sum of timed latencies
+    std::atomic<unsigned long long> nclass[nclasses + 2]; // allocations by cls
 };
 
-struct hh_meta
+// a recent free, remembered for diagnosing later frees of the same pointer
+struct m61_freed
 {
-    long long sz; // total size allocated by call
-    long count; // number of allocations made by call
+    uintptr_t ptr;
+    size_t sz;
+    unsigned site; // where it was allocated
+    unsigned free_site; // where it was freed
 };
 
-struct hh_v_item
+// a freed block waiting in a thread's quarantine
+struct m61_quarantined
 {
-    hh_call_meta call_meta;
-    hh_meta meta;
+    m61_header* hdr;
+    unsigned site; // where it was freed
 };
 
-// metadata map
-// key: pointer to start of allocation
-// value: allocation metatdata struct associated with allocation at pointer
-std::unordered_map<void *, allocation_m> mmap;
+// per-thread allocator state
+// `sites` and `stacks` hold the thread's heavy hitter counters, one chunk
+// per chunk of ids, allocated on first use and read by reporters; the
+// caches and `bins` are touched only by the owner
+struct m61_thread
+{
+    m61_counters stats;
+    m61_latency lat;
+    unsigned lat_left[lat_nops]; // operations of each kind until the next timed one
+    bool lat_timing; // an operation is being timed
+    unsigned sweep_left; // allocations until the next redzone sweep
+    std::deque<m61_quarantined> quarantine; // oldest first
+    m61_freed* history; // ring of the last history_size frees
+    unsigned history_pos; // next `history` entry to overwrite
+    size_t quarantine_size; // bytes in `quarantine`, headers included
+    long long sample_left; // bytes until the next sampled allocation
+    uint64_t rng; // xorshift state for sampling
+    std::atomic<m61_hh_counts*> sites[site_nchunks];
+    std::atomic<m61_hh_counts*> stacks[stack_nchunks];
+    m61_site_cache site_cache[site_ncache];
+    unsigned stack_cache[stack_ncache]; // recently captured stack ids
+    uintptr_t stack_lo; // bounds of the thread's stack, for frame walks
+    uintptr_t stack_hi;
+    m61_trace_record* trace_buf; // trace records not yet written
+    unsigned trace_n; // number of records in `trace_buf`
+    long long active_delta; // change in active bytes not yet in active_total
+    long long active_high; // highest `active_delta` since then
+    std::pair<uintptr_t, uintptr_t> slab_seen[slab_nseen]; // slabs region_holds found, by address
+    m61_tcache_bin bins[nclasses];
+    m61_thread* prev; // registry links
+    m61_thread* next;
+};
+
+m61_depot depots[nclasses];
+// every slab ever created, so slab memory stays reachable
+m61_slab* slab_list = nullptr;
+std::mutex slab_list_lock;
+
+// active list
+// intrusive doubly linked lists of every live allocation, used for leak
+// reports and for finding the region enclosing an invalid free
+const unsigned nshards = 64;
+m61_active_shard active_shards[nshards];
+
+// thread registry
+// every attached thread, plus the folded state of threads that exited
+std::mutex registry_lock;
+m61_thread* threads = nullptr;
+m61_immortal<m61_thread> retired_storage;
+m61_thread& retired = retired_storage.value;
+pthread_key_t thread_key;
+pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+thread_local m61_thread* tls_thread = nullptr;
+
+// address index
+// every slab and large block keyed by start address (a red-black tree),
+// so the block enclosing an arbitrary address is found in O(log n);
+// written only when a slab or large block comes or goes
+m61_immortal<std::map<uintptr_t, m61_region>> regions_storage;
+std::map<uintptr_t, m61_region>& regions = regions_storage.value;
+std::shared_mutex regions_lock;
+
+// heap bounds
+// hull of every region ever indexed, from its first possible user address
+// to its end; kept monotonic so a freed large block at the edge of the
+// heap is still "in heap" when it is freed again
+std::atomic<uintptr_t> heap_min(UINTPTR_MAX);
+std::atomic<uintptr_t> heap_max(0);
+
+// heap layout
+// threads add their change in active bytes to active_total once it
+// reaches peak_slack either way, raising active_peak, so the peak costs
+// no shared write per allocation. meta_size counts slab and slot headers
+// and the allocator's own tables as they are allocated
+const long long peak_slack = 64 << 10;
+std::atomic<long long> active_total(0);
+std::atomic<long long> active_peak(0);
+std::atomic<long long> meta_size(0);
 
-// heavy hitter map
-// key: call location metatdata
-// value: total size of every call at location
-std::unordered_map<hh_call_meta, hh_meta, hh_call_meta_hasher> hhmap;
+// mmap large path
+// blocks of at least M61_MMAP_THRESHOLD bytes (default 1 MiB) get their
+// own mapping, placed so the block ends where the mapping does and
+// followed by a PROT_NONE guard page (unless M61_GUARD_PAGE=0), so an
+// overflow faults at once. free unmaps all but the pages up to the
+// header; the last mmap_nretain of those stay mapped so double frees of recently
+// freed blocks are still diagnosed
+size_t mmap_threshold = 1 << 20;
+size_t mmap_guard;
+size_t page_size;
+const unsigned mmap_nretain = 256;
+std::pair<uintptr_t, size_t> mmap_retained[mmap_nretain];
+unsigned mmap_retain_pos = 0;
+std::mutex mmap_retain_lock;
 
-// initialize l_stats to 0s
-// technically could just use {0} but the compiler yells at me
-m61_statistics l_stats = {0, 0, 0, 0, 0, 0, 0, 0};
+// latency timer
+// every Nth operation is timed; ticks are converted to nanoseconds by
+// comparing the timer with CLOCK_MONOTONIC since lat_tick0 / lat_ns0
+unsigned lat_rate = 0;
+uint64_t lat_tick0;
+uint64_t lat_ns0;
 
 // allocation terminator
 const char trm = '\xff';
+// header canaries; xored with the header address so that a header copied
+// elsewhere (e.g. by memcpy) is not mistaken for a real one
+const uintptr_t hdr_live = 0x6d36316c69766521;
+const uintptr_t hdr_freed = 0x6d36316672656564;
+// header flags
+const unsigned short hdr_sampled = 1;
+const unsigned short hdr_resized = 2; // large block resized in place or over-aligned
+
+// redzones
+// every block is laid out as [rz_left][header][data][rz_right], with both
+// redzones filled with `trm` and checked when the block is freed; by
+// default the only redzone is the one-byte terminator. M61_REDZONE=N in
+// the environment makes both redzones at least N bytes (rz_left stays a
+// multiple of 16) and turns on the shadow map
+size_t rz_left = 0;
+size_t rz_right = sizeof(trm);
+// with M61_SWEEP=N, every Nth allocation by a thread also checks the
+// redzones of every live block; mallocs and frees hold `sweep_lock`
+// shared so no block changes hands during a sweep
+unsigned sweep_every = 0;
+std::shared_mutex sweep_lock;
+
+// free history
+// block metadata lives in block headers, and a freed block keeps only its
+// hdr_freed canary until it is reused, so nothing grows with the number
+// of frees. to still say where a double-freed block was allocated and
+// freed, each thread remembers its last M61_FREE_HISTORY=N (default 256)
+// frees in a ring; older ones are forgotten
+unsigned history_size = 256;
+
+// quarantine
+// with M61_QUARANTINE=N in the environment, each thread holds up to N
+// bytes (headers included) of the blocks it frees (oldest first out) before recycling them.
+// a quarantined block's data is filled with `qpoison`, and a block whose
+// poison changed when it leaves quarantine was written after its free.
+// mmap blocks are unmapped at once instead, so writes to them fault
+size_t quarantine_max = 0;
+const char qpoison = '\xdd';
+
+// shadow map
+// one shadow byte per 8-byte granule of block memory, encoded as in
+// AddressSanitizer: 0 if all 8 bytes are addressable, k if only the
+// first k are, or a shadow_* code. a three-level radix tree of lazily
+// mapped tables covers 48-bit addresses; memory m61 never shadowed reads
+// as addressable. shadow_freed marks freed slab blocks; freed large
+// blocks go back to the system, so their shadow is cleared
+bool shadow_on = false;
+const unsigned shadow_shift = 3;
+const unsigned shadow_leaf_bits = 20; // bytes covered by one leaf table
+const unsigned shadow_mid_bits = 14;
+const unsigned shadow_top_bits = 14;
+const unsigned char shadow_left = 0xfa; // leading redzone or header
+const unsigned char shadow_right = 0xfb; // trailing redzone or slack
+const unsigned char shadow_freed = 0xfd;
+std::atomic<void*> shadow_top[1 << shadow_top_bits];
+
+// site table (see m61_site)
+m61_site site_chunk0[1 << id_chunk_bits] = {{"?", 0}};
+std::atomic<m61_site*> site_chunks[site_nchunks] = {site_chunk0};
+std::atomic<unsigned> nsites(1);
+std::mutex site_lock;
+unsigned* site_index = nullptr; // site + 1 for each indexed site, or 0
+unsigned site_index_size = 0; // a power of 2 above twice nsites
+
+// stack table (see m61_stack), built like the site table
+unsigned stack_depth = 0;
+#if M61_PRELOAD
+// in libm61.so the API is called by an interposed allocation function
+// (m61preload.cc), whose frame is not part of the caller's stack
+const unsigned stack_skip = 1;
+#else
+const unsigned stack_skip = 0;
+#endif
+m61_stack stack_chunk0[1 << id_chunk_bits];
+std::atomic<m61_stack*> stack_chunks[stack_nchunks] = {stack_chunk0};
+std::atomic<unsigned> nstacks(1);
+std::mutex stack_lock;
+unsigned* stack_index = nullptr;
+unsigned stack_index_size = 0;
+
+// allocation trace (see m61trace.hh)
+// with M61_TRACE=FILE in the environment, each thread buffers up to
+// trace_nbuf records and appends them to `trace_fd` under `trace_lock`
+int trace_fd = -1;
+uint64_t trace_ns0;
+std::mutex trace_lock;
+const unsigned trace_nbuf = 1024;
+
+// heap snapshots
+// a snapshot sums the threads' per-site live counters, so taking one
+// never walks the heap. with M61_SNAPSHOT_SIGNAL=N in the environment, a
+// handler for signal N wakes a helper thread through `snapshot_pipe`,
+// and the helper prints the change since its previous snapshot
+struct m61_heap_snapshot
+{
+    std::vector<std::pair<long long, long long>> live; // bytes and blocks by site id
+};
+const unsigned snapshot_top = 20; // growing sites printed by a diff
+int snapshot_pipe[2] = {-1, -1};
+
+// report stream
+// reports print to `report_file`, or to stdout while it is null
+FILE* report_file = nullptr;
+
+// sampling
+// with M61_SAMPLE_RATE=N in the environment, each thread samples an
+// allocation whenever it has allocated an exponentially distributed
+// number of bytes with mean N since its last sample (as tcmalloc's heap
+// profiler does), so an `sz` byte allocation is sampled with probability
+// 1 - exp(-sz/N). only sampled blocks pay for heavy hitter and leak
+// tracking; their weights are scaled by 1/probability so the heavy hitter
+// report stays unbiased. N == 0 (the default) tracks every allocation
+size_t sample_rate = 0;
 // limit percentage to print as heavy_hitter
 const float limit = 0.05;
 
-/// m61_malloc(sz, file, line)
-///    Return a pointer to `sz` bytes of newly-allocated dynamic memory.
-///    The memory is not initialized. If `sz == 0`, then m61_malloc must
-///    return a unique, newly-allocated pointer value. The allocation
-///    request was at location `file`:`line`.
+// size_class(n)
+//    Return the smallest size class holding `n` bytes, or nclasses if
+//    `n` is too big for any slab.
 
-void* m61_malloc(size_t sz, const char* file, long line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
-    if (sz > SIZE_MAX - sizeof(trm))
+static unsigned size_class(size_t n)
+{
+    if (n <= slab_classes[0])
     {
-        l_stats.nfail++;
-        l_stats.fail_size += sz;
-        return nullptr;
+        return 0;
     }
-    void *ptr = base_malloc(sz + sizeof(trm));
-    if (ptr)
+    else if (n > slab_classes[nclasses - 1])
     {
-        if (!l_stats.ntotal)
-        {
-            l_stats.heap_min = (uintptr_t) ptr;
-            l_stats.heap_max = (uintptr_t) ptr + sz;
-        }
-        if ((uintptr_t) ptr + sz > l_stats.heap_max)
+        return nclasses;
+    }
+    // slab_classes[i] == 16 << i
+    return 64 - __builtin_clzll(n - 1) - 4;
+}
+
+// stat_add(c, x)
+//    Add `x` to a counter only the calling thread writes.
+
+static inline void stat_add(std::atomic<unsigned long long> &c, unsigned long long x)
+{
+    c.store(c.load(std::memory_order_relaxed) + x, std::memory_order_relaxed);
+}
+
+// meta_add(n)
+//    Count `n` more bytes (or fewer, if negative) of allocator metadata.
+
+static inline void meta_add(long long n)
+{
+    meta_size.fetch_add(n, std::memory_order_relaxed);
+}
+
+// site_hash(file, line)
+//    Return a well-mixed hash of a call site.
+
+static inline uint64_t site_hash(const char* file, long line)
+{
+    uint64_t h = (uintptr_t) file * 0x9e3779b97f4a7c15ULL + line;
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+// site_get(site)
+//    Return the file and line of interned site `site`, or of site 0 if
+//    `site` is not a site id (it may come from a header copied out of a
+//    never-used slot).
+
+static inline const m61_site& site_get(unsigned site)
+{
+    if (site >= nsites.load(std::memory_order_acquire))
+    {
+        site = 0;
+    }
+    m61_site *chunk = site_chunks[site >> id_chunk_bits].load(std::memory_order_acquire);
+    return chunk[site & ((1 << id_chunk_bits) - 1)];
+}
+
+// site_insert(file, line, h)
+//    Return the site id of `file`:`line`, whose hash is `h`, interning it
+//    if it is new. Returns 0 once the table is full.
+
+static unsigned site_insert(const char* file, long line, uint64_t h)
+{
+    std::lock_guard<std::mutex> guard(site_lock);
+    unsigned n = nsites.load(std::memory_order_relaxed);
+    if (2 * n >= site_index_size)
+    {
+        // grow the index, reinserting every site but site 0
+        unsigned size = std::max(site_index_size * 2, 1024U);
+        unsigned *index = new unsigned[size]();
+        meta_add((long long) (size - site_index_size) * sizeof(unsigned));
+        for (unsigned site = 1; site != n; ++site)
         {
-            l_stats.heap_max = (uintptr_t) ptr + sz;
+            const m61_site &si = site_get(site);
+            unsigned i = site_hash(si.file, si.line) & (size - 1);
+            while (index[i])
+            {
+                i = (i + 1) & (size - 1);
+            }
+            index[i] = site + 1;
         }
-        else if ((uintptr_t) ptr < l_stats.heap_min)
+        delete[] site_index;
+        site_index = index;
+        site_index_size = size;
+    }
+
+    unsigned i = h & (site_index_size - 1);
+    while (site_index[i])
+    {
+        const m61_site &si = site_get(site_index[i] - 1);
+        if (si.file == file && si.line == line)
         {
-            l_stats.heap_min = (uintptr_t) ptr;
+            return site_index[i] - 1;
         }
+        i = (i + 1) & (site_index_size - 1);
+    }
+    if (n == site_max)
+    {
+        return 0;
+    }
+    std::atomic<m61_site*> &chunk = site_chunks[n >> id_chunk_bits];
+    if (!chunk.load(std::memory_order_relaxed))
+    {
+        chunk.store(new m61_site[1 << id_chunk_bits], std::memory_order_release);
+        meta_add(sizeof(m61_site) << id_chunk_bits);
+    }
+    chunk.load(std::memory_order_relaxed)[n & ((1 << id_chunk_bits) - 1)] = {file, line};
+    site_index[i] = n + 1;
+    nsites.store(n + 1, std::memory_order_release);
+    return n;
+}
 
-        l_stats.ntotal++;
-        l_stats.total_size += sz;
-        l_stats.nactive++;
-        l_stats.active_size += sz;
-        mmap[ptr] = {sz, false, file, line};
-        ((char *) ptr)[sz] = trm;
+// site_intern(self, file, line)
+//    Return the site id of `file`:`line`. Repeat calls from the same site
+//    hit `self`'s cache and take no lock.
+
+static inline unsigned site_intern(m61_thread* self, const char* file, long line)
+{
+    uint64_t h = site_hash(file, line);
+    m61_site_cache &c = self->site_cache[(h >> 32) & (site_ncache - 1)];
+    if (__builtin_expect(c.file != file || c.line != line, 0))
+    {
+        c = {file, line, site_insert(file, line, h)};
+    }
+    return c.site;
+}
 
-        // add to heavy hitters map
-        hhmap[(hh_call_meta) {file, line}].sz += sz;
-        ++hhmap[(hh_call_meta) {file, line}].count;
+// stack_get(stack)
+//    Return interned stack `stack`, or the empty stack if `stack` is not a
+//    stack id.
 
-        return ptr;
+static inline const m61_stack& stack_get(unsigned stack)
+{
+    if (stack >= nstacks.load(std::memory_order_acquire))
+    {
+        stack = 0;
     }
-    l_stats.nfail++;
-    l_stats.fail_size += sz;
-    return nullptr;
+    m61_stack *chunk = stack_chunks[stack >> id_chunk_bits].load(std::memory_order_acquire);
+    return chunk[stack & ((1 << id_chunk_bits) - 1)];
 }
 
+// stack_equal(st, site, pcs, depth)
+//    Return true if interned stack `st` was captured at `site` with return
+//    addresses `pcs[0..depth)`.
 
-/// m61_free(ptr, file, line)
-///    Free the memory space pointed to by `ptr`, which must have been
-///    returned by a previous call to m61_malloc. If `ptr == NULL`,
-///    does nothing. The free was called at location `file`:`line`.
+static inline bool stack_equal(const m61_stack& st, unsigned site, const uintptr_t* pcs, unsigned depth)
+{
+    return st.site == site && st.depth == depth && memcmp(st.pcs, pcs, depth * sizeof(uintptr_t)) == 0;
+}
 
-void m61_free(void* ptr, const char* file, long line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
-    if (ptr)
+// stack_insert(site, pcs, depth, h)
+//    Return the stack id of `pcs[0..depth)` captured at `site`, whose hash
+//    is `h`, interning it if it is new. Returns 0 once the table is full.
+
+static unsigned stack_insert(unsigned site, const uintptr_t* pcs, unsigned depth, uint64_t h)
+{
+    std::lock_guard<std::mutex> guard(stack_lock);
+    unsigned n = nstacks.load(std::memory_order_relaxed);
+    if (2 * n >= stack_index_size)
     {
-        if ((uintptr_t) ptr < l_stats.heap_min || (uintptr_t) ptr > l_stats.heap_max)
-        {
-            fprintf(stderr, "MEMORY BUG: %s:%li: invalid free of pointer %p, not in heap\n", file, line, ptr);
-            abort();
-        }
-        else if (!mmap.count(ptr))
+        unsigned size = std::max(stack_index_size * 2, 1024U);
+        unsigned *index = new unsigned[size]();
+        meta_add((long long) (size - stack_index_size) * sizeof(unsigned));
+        for (unsigned stack = 1; stack != n; ++stack)
         {
-            fprintf(stderr, "MEMORY BUG: %s:%li: invalid free of pointer %p, not allocated\n", file, line, ptr);
-            for (auto &pair: mmap)
+            unsigned i = stack_get(stack).hash & (size - 1);
+            while (index[i])
             {
-                // check if ptr is between existing ptr and existing ptr + sz
-                if ((uintptr_t) pair.first < (uintptr_t) ptr && (uintptr_t) pair.first + mmap[pair.first].sz > (uintptr_t) ptr)
-                {
-                    fprintf(
-                        stderr,
-                        "   %s:%li: %p is %li bytes inside a %li byte region allocated here\n",
-                        mmap[pair.first].file,
-                        mmap[pair.first].line,
-                        ptr,
-                        (uintptr_t) ptr - (uintptr_t) pair.first,
-                        mmap[pair.first].sz
-                    );
-                }
+                i = (i + 1) & (size - 1);
             }
-            abort();
-        }
-        else if (mmap[ptr].freed)
-        {
-            fprintf(stderr, "MEMORY BUG: %s:%li: invalid free of pointer %p, double free\n", file, line, ptr);
-            abort();
+            index[i] = stack + 1;
         }
-        else if (((char *) ptr)[mmap[ptr].sz] != trm)
+        delete[] stack_index;
+        stack_index = index;
+        stack_index_size = size;
+    }
+
+    unsigned i = h & (stack_index_size - 1);
+    while (stack_index[i])
+    {
+        const m61_stack &st = stack_get(stack_index[i] - 1);
+        if (st.hash == h && stack_equal(st, site, pcs, depth))
         {
-            fprintf(stderr, "MEMORY BUG: %s:%li: detected wild write during free of pointer %p\n", file, line, ptr);
-            abort();
+            return stack_index[i] - 1;
         }
-
-        base_free(ptr);
-        l_stats.nactive--;
-        l_stats.active_size -= mmap[ptr].sz;
-        mmap[ptr].freed = true;
+        i = (i + 1) & (stack_index_size - 1);
+    }
+    if (n == stack_max)
+    {
+        return 0;
+    }
+    std::atomic<m61_stack*> &chunk = stack_chunks[n >> id_chunk_bits];
+    if (!chunk.load(std::memory_order_relaxed))
+    {
+        chunk.store(new m61_stack[1 << id_chunk_bits], std::memory_order_release);
+        meta_add(sizeof(m61_stack) << id_chunk_bits);
     }
+    uintptr_t *copy = new uintptr_t[depth];
+    meta_add(depth * sizeof(uintptr_t));
+    memcpy(copy, pcs, depth * sizeof(uintptr_t));
+    chunk.load(std::memory_order_relaxed)[n & ((1 << id_chunk_bits) - 1)] = {h, site, depth, copy};
+    stack_index[i] = n + 1;
+    nstacks.store(n + 1, std::memory_order_release);
+    return n;
 }
 
+// stack_capture(self, site, frame)
+//    Return the stack id of the calling thread's stack above `frame`, the
+//    frame of the m61 API function called at `site`. Frames are followed
+//    only while they stay in the thread's stack and move toward its base,
+//    so a frame without a frame pointer ends the walk rather than faulting.
 
-/// m61_calloc(nmemb, sz, file, line)
-///    Return a pointer to newly-allocated dynamic memory big enough to
-///    hold an array of `nmemb` elements of `sz` bytes each. If `sz == 0`,
-///    then must return a unique, newly-allocated pointer value. Returned
-///    memory should be initialized to zero. The allocation request was at
-///    location `file`:`line`.
-
-void* m61_calloc(size_t nmemb, size_t sz, const char* file, long line) {
-    size_t toverflow = nmemb * sz;
-    if (nmemb != 0 && toverflow / nmemb != sz)
+static unsigned stack_capture(m61_thread* self, unsigned site, void* frame)
+{
+    uintptr_t pcs[stack_max_depth];
+    unsigned depth = 0;
+    uint64_t h = site;
+    uintptr_t fp = (uintptr_t) frame;
+    unsigned skip = stack_skip;
+    while (depth != stack_depth && fp >= self->stack_lo && fp < self->stack_hi
+           && self->stack_hi - fp >= 2 * sizeof(uintptr_t) && fp % sizeof(uintptr_t) == 0)
     {
-        l_stats.nfail++;
-        return nullptr;
+        // a frame record is the caller's frame pointer, then the return address
+        const uintptr_t *record = (const uintptr_t *) fp;
+        if (!record[1])
+        {
+            break;
+        }
+        if (skip)
+        {
+            --skip;
+        }
+        else
+        {
+            pcs[depth++] = record[1];
+            h = (h ^ record[1]) * 0x9e3779b97f4a7c15ULL;
+        }
+        if (record[0] <= fp)
+        {
+            break;
+        }
+        fp = record[0];
     }
-    void* ptr = m61_malloc(nmemb * sz, file, line);
-    if (ptr) {
-        memset(ptr, 0, nmemb * sz);
+    h ^= h >> 32;
+
+    unsigned &cached = self->stack_cache[h & (stack_ncache - 1)];
+    const m61_stack &st = stack_get(cached);
+    if (!cached || st.hash != h || !stack_equal(st, site, pcs, depth))
+    {
+        cached = stack_insert(site, pcs, depth, h);
     }
-    return ptr;
+    return cached;
 }
 
-/// m61_realloc(ptr, sz, file, line)
-///    Reallocate the dynamic memory pointed to by `ptr` to hold at least
-///    `sz` bytes, returning a pointer to the new block. If `ptr` is
-///    `nullptr`, behaves like `m61_malloc(sz, file, line)`. If `sz` is 0,
-///    behaves like `m61_free(ptr, file, line)`. The allocation request
-///    was at location `file`:`line`.
+// hh_counts(chunks, id)
+//    Return the heavy hitter counters for site or stack `id` in a thread's
+//    `chunks`, allocating their chunk on first use. Only the thread owning
+//    the counters (or one holding registry_lock while they are not in use)
+//    may call this.
 
-void* m61_realloc(void* ptr, size_t sz, const char* file, long line)
+static inline m61_hh_counts& hh_counts(std::atomic<m61_hh_counts*>* chunks, unsigned id)
 {
-    if (sz == 0)
+    std::atomic<m61_hh_counts*> &chunk = chunks[id >> id_chunk_bits];
+    m61_hh_counts *counts = chunk.load(std::memory_order_relaxed);
+    if (__builtin_expect(!counts, 0))
     {
-        m61_free(ptr, file, line);
-        return nullptr;
+        counts = new m61_hh_counts[1 << id_chunk_bits]();
+        chunk.store(counts, std::memory_order_release);
+        meta_add(sizeof(m61_hh_counts) << id_chunk_bits);
     }
-    else
+    return counts[id & ((1 << id_chunk_bits) - 1)];
+}
+
+// hh_fold(dst, src, nchunks)
+//    Add the heavy hitter counters in `src` into `dst`.
+
+static void hh_fold(std::atomic<m61_hh_counts*>* dst, const std::atomic<m61_hh_counts*>* src, unsigned nchunks)
+{
+    for (unsigned c = 0; c != nchunks; ++c)
     {
-        char *new_ptr = (char *) m61_malloc(sz, file, line);
-        if (ptr)
+        const m61_hh_counts *counts = src[c].load(std::memory_order_acquire);
+        for (unsigned i = 0; counts && i != (1 << id_chunk_bits); ++i)
         {
-            for (size_t i = 0; i < sz; ++i)
+            unsigned long long count = counts[i].count.load(std::memory_order_relaxed);
+            unsigned long long live_count = counts[i].live_count.load(std::memory_order_relaxed);
+            if (count || live_count)
             {
-                new_ptr[i] = ((char *) ptr)[i];
+                m61_hh_counts &d = hh_counts(dst, (c << id_chunk_bits) + i);
+                stat_add(d.bytes, counts[i].bytes.load(std::memory_order_relaxed));
+                stat_add(d.count, count);
+                stat_add(d.live_bytes, counts[i].live_bytes.load(std::memory_order_relaxed));
+                stat_add(d.live_count, live_count);
             }
         }
-
-        m61_free(ptr, file, line);
-        return (void *) new_ptr;
     }
 }
 
+// hh_free(chunks, nchunks)
+//    Free a thread's heavy hitter counters.
 
-/// m61_get_statistics(stats)
-///    Store the current memory statistics in `*stats`.
+static void hh_free(std::atomic<m61_hh_counts*>* chunks, unsigned nchunks)
+{
+    for (unsigned c = 0; c != nchunks; ++c)
+    {
+        if (m61_hh_counts *counts = chunks[c].load(std::memory_order_relaxed))
+        {
+            delete[] counts;
+            meta_add(-(long long) (sizeof(m61_hh_counts) << id_chunk_bits));
+        }
+    }
+}
 
-void m61_get_statistics(m61_statistics* stats) {
-    // Stub: set all statistics to enormous numbers
-    // memset(stats, 255, sizeof(m61_statistics));
-    *stats = l_stats;
+// lat_clock_ns()
+//    Return CLOCK_MONOTONIC in nanoseconds.
+
+static uint64_t lat_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
+// lat_now()
+//    Return the latency timer in ticks.
 
-/// m61_print_statistics()
-///    Print the current memory statistics.
+static inline uint64_t lat_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return lat_clock_ns();
+#endif
+}
 
-void m61_print_statistics() {
-    m61_statistics stats;
-    m61_get_statistics(&stats);
+// lat_record(self, op, ticks)
+//    Add a latency of `ticks` to `self`'s histogram for `op`.
 
-    printf(
-        "alloc count: active %10llu   total %10llu   fail %10llu\n",
-        stats.nactive, stats.ntotal, stats.nfail
-    );
-    printf(
-        "alloc size:  active %10llu   total %10llu   fail %10llu\n",
-        stats.active_size, stats.total_size, stats.fail_size
-    );
+static void lat_record(m61_thread* self, lat_op op, uint64_t ticks)
+{
+    unsigned b = std::min(63 - __builtin_clzll(ticks | 1), (int) lat_nbuckets - 1);
+    stat_add(self->lat.hist[op][b], 1);
+    stat_add(self->lat.ticks[op], ticks);
 }
 
+// lat_begin(self, op)
+//    Start timing an operation if it is the thread's Nth of kind `op`
+//    (one countdown per kind, so alternating mallocs and frees with an
+//    even N still time both). Returns the start time, or 0 if the
+//    operation is not timed (including operations nested in a timed one).
 
-/// m61_print_leak_report()
-///    Print a report of all currently-active allocated blocks of dynamic
-///    memory.
+static inline uint64_t lat_begin(m61_thread* self, lat_op op)
+{
+    if (!lat_rate || self->lat_timing || --self->lat_left[op])
+    {
+        return 0;
+    }
+    self->lat_left[op] = lat_rate;
+    self->lat_timing = true;
+    return lat_now();
+}
 
-void m61_print_leak_report() {
-    for (auto &pair: mmap)
+// lat_end(self, op, start)
+//    Finish timing an operation that lat_begin returned `start` for.
+
+static inline void lat_end(m61_thread* self, lat_op op, uint64_t start)
+{
+    if (start)
     {
-        if (!pair.second.freed)
-        {
-            fprintf(
-                stdout,
-                "LEAK CHECK: %s:%li: allocated object %p with size %li\n",
-                pair.second.file,
-                pair.second.line,
-                pair.first,
-                pair.second.sz
-            );
-        }
+        lat_record(self, op, lat_now() - start);
+        self->lat_timing = false;
     }
 }
 
+// lat_backend_begin(self), lat_backend_end(self, start)
+//    Time a backend call made during a timed operation.
 
-/// m61_print_heavy_hitter_report()
-///    Print a report of heavily-used allocation locations.
+static inline uint64_t lat_backend_begin(m61_thread* self)
+{
+    return self->lat_timing ? lat_now() : 0;
+}
 
-void m61_print_heavy_hitter_report() {
-    std::vector<hh_v_item> hh_v;
-    for (auto &pair: hhmap)
+static inline void lat_backend_end(m61_thread* self, uint64_t start)
+{
+    if (start)
     {
-        hh_v.push_back((hh_v_item) {pair.first, pair.second});
+        lat_record(self, lat_backend, lat_now() - start);
     }
+}
 
+static void quarantine_release(m61_thread* t, size_t max);
 
-    // heavy hitters
-    std::sort(hh_v.begin(), hh_v.end(), [](const hh_v_item &a, hh_v_item &b) {
-                                            return a.meta.sz > b.meta.sz;
-                                        });
-    auto it_hhv = hh_v.begin();
-    while (it_hhv != hh_v.end())
+// trace_write(data, len)
+//    Append `len` bytes at `data` to the trace file.
+
+static void trace_write(const void* data, size_t len)
+{
+    const char *p = (const char *) data;
+    while (len)
     {
-        float percent = (float) it_hhv->meta.sz / l_stats.total_size;
-        if (percent < limit)
+        ssize_t n = write(trace_fd, p, len);
+        if (n < 0 && errno == EINTR)
         {
-            break;
+            continue;
         }
-
-        fprintf(
-            stdout,
-            "HEAVY HITTER: %s:%li: %lli bytes (~%.1f%%)\n",
-            it_hhv->call_meta.file,
-            it_hhv->call_meta.line,
-            it_hhv->meta.sz,
-            percent * 100
-        );
-
-        it_hhv++;
+        else if (n <= 0)
+        {
+            return;
+        }
+        p += n;
+        len -= n;
     }
+}
 
+// trace_flush(t)
+//    Write `t`'s buffered trace records.
 
-    // frequent allocations
-    std::sort(hh_v.begin(), hh_v.end(), [](const hh_v_item &a, hh_v_item &b) {
-                                            return a.meta.count > b.meta.count;
-                                        });
-    it_hhv = hh_v.begin();
-    while (it_hhv != hh_v.end())
+static void trace_flush(m61_thread* t)
+{
+    if (t->trace_n)
+    {
+        std::lock_guard<std::mutex> guard(trace_lock);
+        trace_write(t->trace_buf, t->trace_n * sizeof(m61_trace_record));
+        t->trace_n = 0;
+    }
+}
+
+// trace_record(self, op, ptr, old_ptr, sz, site)
+//    Add a record to `self`'s trace buffer if tracing is on.
+
+static inline void trace_record(m61_thread* self, m61_trace_op op, void* ptr, void* old_ptr,
+                                size_t sz, unsigned site)
+{
+    if (self->trace_buf)
+    {
+        self->trace_buf[self->trace_n++] = {
+            lat_clock_ns() - trace_ns0, (uintptr_t) ptr, (uintptr_t) old_ptr, sz, site, op
+        };
+        if (self->trace_n == trace_nbuf)
+        {
+            trace_flush(self);
+        }
+    }
+}
+
+// trace_exit()
+//    atexit handler: write the exiting thread's trace records.
+
+static void trace_exit()
+{
+    m61_trace_flush();
+}
+
+// thread_fold(dst, src)
+//    Add the statistics and heavy hitters of `src` into `dst`. Caller
+//    must make sure neither is being modified.
+
+static void thread_fold(m61_thread* dst, const m61_thread* src)
+{
+    stat_add(dst->stats.nactive, src->stats.nactive);
+    stat_add(dst->stats.active_size, src->stats.active_size);
+    stat_add(dst->stats.ntotal, src->stats.ntotal);
+    stat_add(dst->stats.total_size, src->stats.total_size);
+    stat_add(dst->stats.nfail, src->stats.nfail);
+    stat_add(dst->stats.fail_size, src->stats.fail_size);
+    stat_add(dst->stats.nrealloc, src->stats.nrealloc);
+    stat_add(dst->stats.nrealloc_inplace, src->stats.nrealloc_inplace);
+    for (unsigned op = 0; op != lat_nops; ++op)
+    {
+        for (unsigned b = 0; b != lat_nbuckets; ++b)
+        {
+            stat_add(dst->lat.hist[op][b], src->lat.hist[op][b]);
+        }
+        stat_add(dst->lat.ticks[op], src->lat.ticks[op]);
+    }
+    for (unsigned cls = 0; cls != nclasses + 2; ++cls)
+    {
+        stat_add(dst->lat.nclass[cls], src->lat.nclass[cls]);
+        stat_add(dst->stats.classes[cls].nactive, src->stats.classes[cls].nactive);
+        stat_add(dst->stats.classes[cls].active_size, src->stats.classes[cls].active_size);
+        stat_add(dst->stats.classes[cls].reserved_size, src->stats.classes[cls].reserved_size);
+    }
+    hh_fold(dst->sites, src->sites, site_nchunks);
+    hh_fold(dst->stacks, src->stacks, stack_nchunks);
+}
+
+// active_flush(t)
+//    Add `t`'s change in active bytes to active_total, raising active_peak
+//    to the highest total `t` reached since its last flush. Only `t`'s
+//    owner may call this.
+
+static void active_flush(m61_thread* t)
+{
+    long long total = active_total.fetch_add(t->active_delta, std::memory_order_relaxed);
+    long long high = total + t->active_high;
+    long long peak = active_peak.load(std::memory_order_relaxed);
+    while (high > peak
+           && !active_peak.compare_exchange_weak(peak, high, std::memory_order_relaxed))
+    {
+    }
+    t->active_delta = t->active_high = 0;
+}
+
+// thread_meta_size(t)
+//    Return the bytes of allocator metadata in `t` itself.
+
+static size_t thread_meta_size(const m61_thread* t)
+{
+    return sizeof(m61_thread) + (t->history ? history_size * sizeof(m61_freed) : 0)
+        + (t->trace_buf ? trace_nbuf * sizeof(m61_trace_record) : 0);
+}
+
+// thread_detach(arg)
+//    pthread key destructor: hand an exiting thread's cached blocks back
+//    to the depots and fold its statistics into `retired`.
+
+static void thread_detach(void* arg)
+{
+    m61_thread *t = (m61_thread *) arg;
+    quarantine_release(t, 0);
+    active_flush(t);
+    meta_add(-(long long) thread_meta_size(t));
+    if (t->trace_buf)
+    {
+        trace_flush(t);
+        delete[] t->trace_buf;
+    }
+    for (unsigned cls = 0; cls != nclasses; ++cls)
+    {
+        std::lock_guard<std::mutex> guard(depots[cls].lock);
+        while (m61_header *hdr = t->bins[cls].head)
+        {
+            t->bins[cls].head = hdr->next;
+            hdr->next = depots[cls].loose;
+            depots[cls].loose = hdr;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        thread_fold(&retired, t);
+        if (t->prev)
+        {
+            t->prev->next = t->next;
+        }
+        else
+        {
+            threads = t->next;
+        }
+        if (t->next)
+        {
+            t->next->prev = t->prev;
+        }
+    }
+    tls_thread = nullptr;
+    delete[] t->history;
+    hh_free(t->sites, site_nchunks);
+    hh_free(t->stacks, stack_nchunks);
+    delete t;
+}
+
+// snapshot_signal(signo)
+//    Signal handler: wake the snapshot thread. Async-signal-safe.
+
+static void snapshot_signal(int)
+{
+    int saved_errno = errno;
+    char c = 0;
+    ssize_t n = write(snapshot_pipe[1], &c, 1);
+    (void) n;
+    errno = saved_errno;
+}
+
+static void snapshot_print_diff(FILE* f, const m61_heap_snapshot* a, const m61_heap_snapshot* b);
+
+// snapshot_thread(arg)
+//    Print the change in the heap since the previous signal, or since
+//    startup, each time a signal arrives.
+
+static void* snapshot_thread(void*)
+{
+    m61_heap_snapshot *prev = nullptr;
+    while (true)
+    {
+        char c;
+        ssize_t n = read(snapshot_pipe[0], &c, 1);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n <= 0)
+        {
+            break;
+        }
+        m61_heap_snapshot *snap = m61_snapshot();
+        snapshot_print_diff(stderr, prev, snap);
+        m61_snapshot_free(prev);
+        prev = snap;
+    }
+    m61_snapshot_free(prev);
+    return nullptr;
+}
+
+// snapshot_start(signo)
+//    Print heap changes whenever the process receives signal `signo`.
+
+static void snapshot_start(int signo)
+{
+    pthread_t helper;
+    if (pipe2(snapshot_pipe, O_CLOEXEC) != 0)
+    {
+        return;
+    }
+    if (pthread_create(&helper, nullptr, snapshot_thread, nullptr) != 0)
+    {
+        close(snapshot_pipe[0]);
+        close(snapshot_pipe[1]);
+        return;
+    }
+    pthread_detach(helper);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = snapshot_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signo, &sa, nullptr);
+}
+
+// thread_key_create()
+//    One-time setup: create the thread key and read the configuration.
+
+static void thread_key_create()
+{
+    pthread_key_create(&thread_key, thread_detach);
+    if (const char *rate = getenv("M61_SAMPLE_RATE"))
+    {
+        sample_rate = strtoull(rate, nullptr, 0);
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+    mmap_guard = page_size;
+    if (const char *threshold = getenv("M61_MMAP_THRESHOLD"))
+    {
+        mmap_threshold = strtoull(threshold, nullptr, 0);
+    }
+    if (const char *guard = getenv("M61_GUARD_PAGE"))
+    {
+        mmap_guard = strtol(guard, nullptr, 0) ? page_size : 0;
+    }
+    if (const char *redzone = getenv("M61_REDZONE"))
+    {
+        size_t n = strtoull(redzone, nullptr, 0);
+        if (n && n < 65536)
+        {
+            rz_left = (n + alignof(std::max_align_t) - 1) & -alignof(std::max_align_t);
+            rz_right = n;
+            shadow_on = true;
+        }
+    }
+    if (const char *cache = getenv("M61_CACHE_ALIGN"))
+    {
+        slab_align = strtol(cache, nullptr, 0) ? cache_line : alignof(std::max_align_t);
+    }
+    for (unsigned cls = 0; cls != nclasses; ++cls)
+    {
+        slab_stride[cls] = (sizeof(m61_header) + slab_classes[cls] + slab_align - 1) & -slab_align;
+    }
+    if (const char *history = getenv("M61_FREE_HISTORY"))
+    {
+        history_size = strtoul(history, nullptr, 0);
+    }
+    if (const char *quarantine = getenv("M61_QUARANTINE"))
+    {
+        quarantine_max = strtoull(quarantine, nullptr, 0);
+    }
+    if (const char *sweep = getenv("M61_SWEEP"))
+    {
+        sweep_every = strtoul(sweep, nullptr, 0);
+    }
+    if (const char *depth = getenv("M61_STACK_DEPTH"))
+    {
+        stack_depth = std::min(strtoul(depth, nullptr, 0), (unsigned long) stack_max_depth);
+    }
+    if (const char *trace = getenv("M61_TRACE"))
+    {
+        trace_fd = open(trace, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (trace_fd >= 0)
+        {
+            m61_trace_header header;
+            memcpy(header.magic, m61_trace_magic, sizeof(header.magic));
+            header.version = m61_trace_version;
+            header.record_size = sizeof(m61_trace_record);
+            trace_write(&header, sizeof(header));
+            trace_ns0 = lat_clock_ns();
+            atexit(trace_exit);
+        }
+    }
+    if (const char *signo = getenv("M61_SNAPSHOT_SIGNAL"))
+    {
+        snapshot_start(strtol(signo, nullptr, 0));
+    }
+    if (const char *rate = getenv("M61_LATENCY_SAMPLE"))
+    {
+        lat_rate = strtoul(rate, nullptr, 0);
+    }
+    lat_tick0 = lat_now();
+    lat_ns0 = lat_clock_ns();
+}
+
+// sample_next(t)
+//    Draw the number of bytes `t` allocates before its next sample.
+
+static void sample_next(m61_thread* t)
+{
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    // uniform in (0, 1]
+    double u = ((t->rng >> 11) + 1) * (1.0 / (1ULL << 53));
+    t->sample_left = (long long) (-log(u) * sample_rate) + 1;
+}
+
+// thread_attach()
+//    Create and register allocator state for the calling thread.
+
+static m61_thread* thread_attach()
+{
+    pthread_once(&thread_key_once, thread_key_create);
+    m61_thread *t = new m61_thread();
+    // seed from the attach order so sampled runs are reproducible
+    static std::atomic<uint64_t> nattached(0);
+    t->rng = (++nattached * 0x9e3779b97f4a7c15ULL) | 1;
+    sample_next(t);
+    std::fill(t->lat_left, t->lat_left + lat_nops, lat_rate);
+    t->sweep_left = sweep_every;
+    t->history = history_size ? new m61_freed[history_size]() : nullptr;
+    t->trace_buf = trace_fd >= 0 ? new m61_trace_record[trace_nbuf] : nullptr;
+    meta_add(thread_meta_size(t));
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
+    {
+        void *stack;
+        size_t stack_size;
+        pthread_attr_getstack(&attr, &stack, &stack_size);
+        t->stack_lo = (uintptr_t) stack;
+        t->stack_hi = (uintptr_t) stack + stack_size;
+        pthread_attr_destroy(&attr);
+    }
+    pthread_setspecific(thread_key, t);
+
+    std::lock_guard<std::mutex> guard(registry_lock);
+    t->prev = nullptr;
+    t->next = threads;
+    if (threads)
+    {
+        threads->prev = t;
+    }
+    threads = t;
+    tls_thread = t;
+    return t;
+}
+
+// thread_self()
+//    Return the calling thread's allocator state.
+
+static inline m61_thread* thread_self()
+{
+    m61_thread *t = tls_thread;
+    if (__builtin_expect(!t, 0))
+    {
+        t = thread_attach();
+    }
+    return t;
+}
+
+// shard_of(hdr)
+//    Return the active list shard that owns `hdr`.
+
+static inline m61_active_shard& shard_of(m61_header* hdr)
+{
+    return active_shards[((uintptr_t) hdr * 0x9e3779b97f4a7c15ULL) >> 58];
+}
+static_assert(nshards == 64, "shard_of assumes 64 shards");
+
+// active_link(hdr)
+//    Push `hdr` onto the front of its active list.
+
+static void active_link(m61_header* hdr)
+{
+    m61_active_shard &shard = shard_of(hdr);
+    std::lock_guard<m61_spinlock> guard(shard.lock);
+    hdr->prev = nullptr;
+    hdr->next = shard.head;
+    if (shard.head)
+    {
+        shard.head->prev = hdr;
+    }
+    shard.head = hdr;
+}
+
+// active_unlink(hdr)
+//    Remove `hdr` from its active list.
+
+static void active_unlink(m61_header* hdr)
+{
+    m61_active_shard &shard = shard_of(hdr);
+    std::lock_guard<m61_spinlock> guard(shard.lock);
+    if (hdr->prev)
+    {
+        hdr->prev->next = hdr->next;
+    }
+    else
+    {
+        shard.head = hdr->next;
+    }
+    if (hdr->next)
+    {
+        hdr->next->prev = hdr->prev;
+    }
+}
+
+// region_insert(start, size, stride)
+//    Add a slab or large block to the address index and widen the heap
+//    bounds to cover it.
+
+static void region_insert(uintptr_t start, size_t size, size_t stride)
+{
+    std::unique_lock<std::shared_mutex> guard(regions_lock);
+    regions[start] = {size, stride};
+    if (start + rz_left + sizeof(m61_header) < heap_min.load(std::memory_order_relaxed))
+    {
+        heap_min.store(start + rz_left + sizeof(m61_header));
+    }
+    if (start + size > heap_max.load(std::memory_order_relaxed))
+    {
+        heap_max.store(start + size);
+    }
+}
+
+// region_erase(start)
+//    Remove the large block at `start` from the address index.
+
+static size_t region_erase(uintptr_t start)
+{
+    std::unique_lock<std::shared_mutex> guard(regions_lock);
+    auto it = regions.find(start);
+    size_t size = it->second.size;
+    regions.erase(it);
+    return size;
+}
+
+// shadow_table(slot, size, create)
+//    Return the table of `size` bytes `slot` points to. If there is none
+//    and `create` is true, map a zeroed one first; otherwise return nullptr.
+
+static void* shadow_table(std::atomic<void*>& slot, size_t size, bool create)
+{
+    void *table = slot.load(std::memory_order_acquire);
+    if (!table && create)
+    {
+        void *fresh = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (fresh == MAP_FAILED)
+        {
+            fprintf(stderr, "m61: out of memory for the shadow map\n");
+            abort();
+        }
+        if (slot.compare_exchange_strong(table, fresh, std::memory_order_acq_rel))
+        {
+            table = fresh;
+        }
+        else
+        {
+            munmap(fresh, size);
+        }
+    }
+    return table;
+}
+
+// shadow_leaf(addr, create)
+//    Return the shadow bytes of the leaf covering `addr`, creating them if
+//    `create` is true; otherwise nullptr if `addr` was never shadowed.
+
+static unsigned char* shadow_leaf(uintptr_t addr, bool create)
+{
+    unsigned top = (addr >> (shadow_leaf_bits + shadow_mid_bits)) & ((1 << shadow_top_bits) - 1);
+    unsigned mid = (addr >> shadow_leaf_bits) & ((1 << shadow_mid_bits) - 1);
+    auto *mids = (std::atomic<void*> *) shadow_table(
+        shadow_top[top], sizeof(std::atomic<void*>) << shadow_mid_bits, create
+    );
+    if (!mids)
+    {
+        return nullptr;
+    }
+    return (unsigned char *) shadow_table(mids[mid], 1 << (shadow_leaf_bits - shadow_shift), create);
+}
+
+// shadow_set(start, end, value)
+//    Set the shadow of the granules in [`start`, `end`) to `value`.
+//    `start` and `end` must be multiples of 8.
+
+static void shadow_set(uintptr_t start, uintptr_t end, unsigned char value)
+{
+    const uintptr_t leaf_mask = ((uintptr_t) 1 << shadow_leaf_bits) - 1;
+    while (start < end)
+    {
+        uintptr_t leaf_end = std::min(end, (start | leaf_mask) + 1);
+        if (unsigned char *leaf = shadow_leaf(start, value != 0))
+        {
+            memset(leaf + ((start & leaf_mask) >> shadow_shift), value,
+                   (leaf_end - start) >> shadow_shift);
+        }
+        start = leaf_end;
+    }
+}
+
+// shadow_get(addr)
+//    Return the shadow of the granule holding `addr`.
+
+static unsigned char shadow_get(uintptr_t addr)
+{
+    unsigned char *leaf = shadow_leaf(addr, false);
+    return leaf ? leaf[(addr & (((uintptr_t) 1 << shadow_leaf_bits) - 1)) >> shadow_shift] : 0;
+}
+
+// slab_slots(slab, end)
+//    Return the first slot of `slab` and set `*end` to the end of its last
+//    slot. Slots start where their data is aligned to slab_align.
+
+static char* slab_slots(m61_slab* slab, char** end)
+{
+    size_t stride = slab_stride[slab->cls];
+    uintptr_t data = ((uintptr_t) (slab + 1) + rz_left + sizeof(m61_header) + slab_align - 1)
+        & -slab_align;
+    char *first = (char *) (data - sizeof(m61_header) - rz_left);
+    *end = first + ((char *) slab + slab_size - first) / stride * stride;
+    return first;
+}
+
+// depot_carve(depot, cls, n)
+//    Carve up to `n` never-used slots of class `cls` from the newest slab,
+//    starting a new slab if it is exhausted, and return them as a list.
+//    Caller must hold `depot.lock`.
+
+static m61_header* depot_carve(m61_depot &depot, unsigned cls, unsigned n)
+{
+    size_t stride = slab_stride[cls];
+    if (depot.bump == depot.bump_end)
+    {
+        m61_slab *slab = (m61_slab *) base_malloc(slab_size);
+        if (!slab)
+        {
+            return nullptr;
+        }
+        slab->cls = cls;
+        {
+            std::lock_guard<std::mutex> guard(slab_list_lock);
+            slab->next = slab_list;
+            slab_list = slab;
+        }
+        depot.bump = slab_slots(slab, &depot.bump_end);
+        size_t nslots = (depot.bump_end - depot.bump) / stride;
+        // slot headers and the slab's own header, padding and tail
+        meta_add(slab_size - nslots * (stride - sizeof(m61_header)));
+        region_insert((uintptr_t) depot.bump, nslots * stride, stride);
+    }
+
+    // link slots in address order so they are handed out in that order
+    m61_header *list = nullptr;
+    m61_header **tail = &list;
+    for (; n != 0 && depot.bump != depot.bump_end; --n)
+    {
+        m61_header *hdr = (m61_header *) (depot.bump + rz_left);
+        depot.bump += stride;
+        hdr->canary = 0;
+        *tail = hdr;
+        tail = &hdr->next;
+    }
+    *tail = nullptr;
+    return list;
+}
+
+// tcache_fill(bin, cls)
+//    Refill an empty thread cache bin from the depot. Returns false if
+//    out of memory.
+
+static bool tcache_fill(m61_tcache_bin &bin, unsigned cls)
+{
+    m61_depot &depot = depots[cls];
+    std::lock_guard<std::mutex> guard(depot.lock);
+    if (depot.mags)
+    {
+        bin.head = depot.mags;
+        bin.count = mag_size;
+        depot.mags = depot.mags->prev;
+        return true;
+    }
+
+    bin.count = 0;
+    while (depot.loose && bin.count != mag_size)
+    {
+        m61_header *hdr = depot.loose;
+        depot.loose = hdr->next;
+        hdr->next = bin.head;
+        bin.head = hdr;
+        ++bin.count;
+    }
+    if (bin.count == 0)
+    {
+        bin.head = depot_carve(depot, cls, mag_size);
+        for (m61_header *hdr = bin.head; hdr; hdr = hdr->next)
+        {
+            ++bin.count;
+        }
+    }
+    return bin.head != nullptr;
+}
+
+// tcache_drain(bin, cls)
+//    Move one full magazine from an overfull thread cache bin to the depot.
+
+static void tcache_drain(m61_tcache_bin &bin, unsigned cls)
+{
+    m61_header *mag = bin.head;
+    m61_header *tail = mag;
+    for (unsigned i = 1; i != mag_size; ++i)
+    {
+        tail = tail->next;
+    }
+    bin.head = tail->next;
+    bin.count -= mag_size;
+    tail->next = nullptr;
+
+    m61_depot &depot = depots[cls];
+    std::lock_guard<std::mutex> guard(depot.lock);
+    mag->prev = depot.mags;
+    depot.mags = mag;
+}
+
+// mmap_extent(start, body)
+//    Return the length of the mapping holding the `body` bytes at `start`,
+//    excluding its guard page.
+
+static size_t mmap_extent(uintptr_t start, size_t body)
+{
+    return ((start + body + page_size - 1) & -page_size) - (start & -page_size);
+}
+
+// mmap_body(sz)
+//    Return the bytes an mmap block of size `sz` occupies: redzones,
+//    header and data, rounded up to keep the header aligned.
+
+static size_t mmap_body(size_t sz)
+{
+    return (rz_left + sizeof(m61_header) + sz + rz_right + alignof(std::max_align_t) - 1)
+        & -alignof(std::max_align_t);
+}
+
+// mmap_alloc(sz, align)
+//    Map a block of size `sz` ending at a guard page, with its data aligned
+//    to `align` (a power of 2 no larger than page_size).
+
+static m61_header* mmap_alloc(size_t sz, size_t align)
+{
+    if (sz > SIZE_MAX / 2)
+    {
+        return nullptr;
+    }
+    // the data ends on a page boundary, so rounding its length up to a
+    // multiple of `align` aligns its start (and matches mmap_body by default)
+    size_t body = rz_left + sizeof(m61_header) + ((sz + rz_right + align - 1) & -align);
+    size_t len = (body + page_size - 1) & -page_size;
+    char *map = (char *) mmap(nullptr, len + mmap_guard, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    if (mmap_guard)
+    {
+        mprotect(map + len, mmap_guard, PROT_NONE);
+    }
+    region_insert((uintptr_t) map + len - body, body, 0);
+    return (m61_header *) (map + len - body + rz_left);
+}
+
+// mmap_free(hdr)
+//    Unmap the mmap block `hdr`, whose canary is already hdr_freed, except
+//    for the pages up to its header, which join the retained pages.
+
+static void mmap_free(m61_header* hdr)
+{
+    uintptr_t start = (uintptr_t) hdr - rz_left;
+    size_t body = region_erase(start);
+    size_t len = mmap_extent(start, body) + mmap_guard;
+    uintptr_t map = start & -page_size;
+    size_t keep = mmap_extent(start, rz_left + sizeof(m61_header));
+    if (shadow_on)
+    {
+        shadow_set(start, start + body, 0);
+    }
+    munmap((void *) (map + keep), len - keep);
+
+    std::pair<uintptr_t, size_t> evicted;
+    {
+        std::lock_guard<std::mutex> guard(mmap_retain_lock);
+        evicted = mmap_retained[mmap_retain_pos];
+        mmap_retained[mmap_retain_pos] = {map, keep};
+        mmap_retain_pos = (mmap_retain_pos + 1) % mmap_nretain;
+    }
+    if (evicted.first)
+    {
+        munmap((void *) evicted.first, evicted.second);
+    }
+}
+
+// mmap_grow(hdr, sz)
+//    Remap the live mmap block `hdr` to hold `sz` bytes, moving it if the
+//    pages after it are taken. The data stays put relative to the header,
+//    so a grown block no longer ends exactly at its guard page. Returns
+//    the block's new header, or nullptr (leaving the block alone) on
+//    failure. The caller must unlink the block from the active list.
+
+static m61_header* mmap_grow(m61_header* hdr, size_t sz)
+{
+    if (sz > SIZE_MAX / 2)
+    {
+        return nullptr;
+    }
+    uintptr_t start = (uintptr_t) hdr - rz_left;
+    size_t body = region_erase(start);
+    size_t new_body = mmap_body(sz);
+    uintptr_t map = start & -page_size;
+    size_t len = mmap_extent(start, body);
+    size_t new_len = mmap_extent(start, new_body);
+    // mremap cannot span the separately protected guard page, so unprotect
+    // it (it merges back into the block's mapping) and protect the new
+    // last page afterward
+    if (mmap_guard)
+    {
+        mprotect((void *) (map + len), mmap_guard, PROT_READ | PROT_WRITE);
+    }
+    char *new_map = (char *) mremap((void *) map, len + mmap_guard, new_len + mmap_guard,
+                                    MREMAP_MAYMOVE);
+    if (new_map == MAP_FAILED)
+    {
+        if (mmap_guard)
+        {
+            mprotect((void *) (map + len), mmap_guard, PROT_NONE);
+        }
+        region_insert(start, body, 0);
+        return nullptr;
+    }
+    if (mmap_guard)
+    {
+        mprotect(new_map + new_len, mmap_guard, PROT_NONE);
+    }
+    start = (uintptr_t) new_map + (start - map);
+    hdr = (m61_header *) (start + rz_left);
+    __atomic_store_n(&hdr->canary, hdr_live ^ (uintptr_t) hdr, __ATOMIC_RELAXED);
+    region_insert(start, new_body, 0);
+    return hdr;
+}
+
+// block_alloc(self, sz, align)
+//    Return a block with room for redzones, a header and `sz` bytes
+//    aligned to `align` (a power of 2), or nullptr if out of memory. Sets
+//    the block's `cls`. Slab slots are aligned to slab_align, so blocks
+//    aligned beyond that are large blocks.
+
+static m61_header* block_alloc(m61_thread* self, size_t sz, size_t align)
+{
+    unsigned cls = size_class(rz_left + sz + rz_right);
+    if (align > slab_align)
+    {
+        cls = nclasses;
+    }
+    m61_header *hdr;
+    if (cls == nclasses && sz >= mmap_threshold && align <= page_size)
+    {
+        uint64_t start = lat_backend_begin(self);
+        hdr = mmap_alloc(sz, align);
+        lat_backend_end(self, start);
+        if (!hdr)
+        {
+            return nullptr;
+        }
+        cls = cls_mmap;
+    }
+    else if (cls == nclasses)
+    {
+        uint64_t start = lat_backend_begin(self);
+        // over-allocate so the block can start `pad` bytes in, where its
+        // data is aligned; the region runs from there to the end
+        size_t size = rz_left + sizeof(m61_header) + sz + rz_right;
+        if (align > alignof(std::max_align_t))
+        {
+            size += align - alignof(std::max_align_t);
+        }
+        hdr = nullptr;
+        if (char *base = (char *) base_malloc(size))
+        {
+            uintptr_t data = ((uintptr_t) base + rz_left + sizeof(m61_header) + align - 1) & -align;
+            char *region = (char *) data - sizeof(m61_header) - rz_left;
+            region_insert((uintptr_t) region, base + size - region, 0);
+            hdr = (m61_header *) (region + rz_left);
+            hdr->pad = region - base;
+        }
+        lat_backend_end(self, start);
+        if (!hdr)
+        {
+            return nullptr;
+        }
+    }
+    else
+    {
+        m61_tcache_bin &bin = self->bins[cls];
+        if (!bin.head)
+        {
+            uint64_t start = lat_backend_begin(self);
+            bool filled = tcache_fill(bin, cls);
+            lat_backend_end(self, start);
+            if (!filled)
+            {
+                return nullptr;
+            }
+        }
+        hdr = bin.head;
+        bin.head = hdr->next;
+        --bin.count;
+    }
+    hdr->cls = cls;
+    stat_add(self->lat.nclass[cls], 1);
+    return hdr;
+}
+
+// block_free(self, hdr)
+//    Return the block `hdr` to the thread cache for its class, or to
+//    base_free if it did not come from a slab. The header itself is left
+//    readable so a later double free can still be diagnosed.
+
+static void block_free(m61_thread* self, m61_header* hdr)
+{
+    if (hdr->cls == cls_mmap || hdr->cls == cls_base)
+    {
+        uint64_t start = lat_backend_begin(self);
+        if (hdr->cls == cls_mmap)
+        {
+            mmap_free(hdr);
+        }
+        else
+        {
+            char *region = (char *) hdr - rz_left;
+            size_t size = region_erase((uintptr_t) region);
+            if (shadow_on)
+            {
+                shadow_set((uintptr_t) region, ((uintptr_t) region + size + 7) & -8, 0);
+            }
+            base_free(region - hdr->pad);
+        }
+        lat_backend_end(self, start);
+        return;
+    }
+    m61_tcache_bin &bin = self->bins[hdr->cls];
+    hdr->next = bin.head;
+    bin.head = hdr;
+    if (++bin.count >= 2 * mag_size)
+    {
+        uint64_t start = lat_backend_begin(self);
+        tcache_drain(bin, hdr->cls);
+        lat_backend_end(self, start);
+    }
+}
+
+// poison_mismatch(data, n)
+//    Return the offset of the first of the `n` bytes at `data` that is not
+//    qpoison, or `n` if there is none.
+
+static size_t poison_mismatch(const char* data, size_t n)
+{
+    static const std::string poison(4096, qpoison);
+    for (size_t off = 0; off < n; off += poison.size())
+    {
+        size_t len = std::min(n - off, poison.size());
+        if (memcmp(data + off, poison.data(), len) != 0)
+        {
+            while (data[off] == qpoison)
+            {
+                ++off;
+            }
+            return off;
+        }
+    }
+    return n;
+}
+
+// quarantine_release(t, max)
+//    Recycle the oldest blocks in `t`'s quarantine until it holds at most
+//    `max` bytes, reporting any block written since it was freed.
+
+static void quarantine_release(m61_thread* t, size_t max)
+{
+    while (t->quarantine_size > max)
+    {
+        m61_quarantined q = t->quarantine.front();
+        t->quarantine.pop_front();
+        const char *data = (const char *) (q.hdr + 1);
+        size_t i = poison_mismatch(data, q.hdr->sz);
+        if (i != q.hdr->sz)
+        {
+            const m61_site &freed = site_get(q.site), &allocated = site_get(q.hdr->site);
+            fprintf(stderr, "MEMORY BUG: %s:%li: pointer %p was written after this free, %zu bytes into a %zu byte region\n",
+                    freed.file, freed.line, (void *) data, i, q.hdr->sz);
+            fprintf(stderr, "   %s:%li: %p was allocated here\n", allocated.file, allocated.line,
+                    (void *) data);
+            abort();
+        }
+        t->quarantine_size -= sizeof(m61_header) + q.hdr->sz;
+        block_free(t, q.hdr);
+    }
+}
+
+// find_slot(addr, copy)
+//    Return the header of the slab slot or large block whose memory,
+//    redzones included, contains `addr`, and copy it into `*copy`; the
+//    block may be live, freed, or (in a slab) never used. Returns nullptr
+//    if `addr` is in no region. Looks up the region holding `addr` in the
+//    address index, then the slot within it, so this costs O(log n)
+//    rather than a heap scan.
+
+static m61_header* find_slot(uintptr_t addr, m61_header* copy)
+{
+    std::shared_lock<std::shared_mutex> guard(regions_lock);
+    auto it = regions.upper_bound(addr);
+    if (it == regions.begin())
+    {
+        return nullptr;
+    }
+    --it;
+    uintptr_t off = addr - it->first;
+    if (off >= it->second.size)
+    {
+        return nullptr;
+    }
+
+    uintptr_t slot = it->first;
+    if (it->second.stride)
+    {
+        slot += off - off % it->second.stride;
+    }
+    m61_header *hdr = (m61_header *) (slot + rz_left);
+    *copy = *hdr;
+    return hdr;
+}
+
+// region_holds(self, addr, len)
+//    Return true if the `len` bytes at `addr` lie in one slab or large
+//    block, or in the header page kept from a freed large block, so they
+//    are mapped and safe to read. Slabs are never unindexed, so those
+//    found are remembered in `self` and checked without taking the index
+//    lock.
+
+static bool region_holds(m61_thread* self, uintptr_t addr, size_t len)
+{
+    auto &seen = self->slab_seen[addr / slab_size % slab_nseen];
+    if (addr >= seen.first && addr + len <= seen.second)
+    {
+        return true;
+    }
+    {
+        std::shared_lock<std::shared_mutex> guard(regions_lock);
+        auto it = regions.upper_bound(addr);
+        if (it != regions.begin() && addr - (--it)->first + len <= it->second.size)
+        {
+            if (it->second.stride)
+            {
+                seen = {it->first, it->first + it->second.size};
+            }
+            return true;
+        }
+    }
+    std::lock_guard<std::mutex> guard(mmap_retain_lock);
+    for (auto &kept: mmap_retained)
+    {
+        if (addr >= kept.first && addr + len <= kept.first + kept.second)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// find_enclosing(ptr, enc)
+//    Copy the header of the active block containing `ptr` into `*enc` and
+//    return the block's user address. Returns 0 if there is no such block.
+
+static uintptr_t find_enclosing(void* ptr, m61_header* enc)
+{
+    m61_header *hdr = find_slot((uintptr_t) ptr, enc);
+    uintptr_t start = (uintptr_t) (hdr + 1);
+    if (!hdr || enc->canary != (hdr_live ^ (uintptr_t) hdr)
+        || (uintptr_t) ptr <= start || (uintptr_t) ptr >= start + enc->sz)
+    {
+        return 0;
+    }
+    return start;
+}
+
+
+// sample_weight(sz, r, bytes, count)
+//    Set `*bytes` and `*count` to the bytes and allocations that a sampled
+//    allocation of `sz` bytes stands for. The weights are fractional, so
+//    they are rounded up or down at random, by the top bits of `r`, with
+//    the odds that keep the sums unbiased.
+
+static inline void sample_weight(size_t sz, uint64_t r, unsigned long long* bytes,
+                                 unsigned long long* count)
+{
+    *bytes = sz;
+    *count = 1;
+    if (sample_rate)
+    {
+        double weight = 1 / -expm1(-(double) sz / sample_rate);
+        // uniform in [0, 1)
+        double u = (r >> 11) * (1.0 / (1ULL << 53));
+        *bytes = (unsigned long long) (sz * weight + u);
+        *count = (unsigned long long) (weight + u);
+    }
+}
+
+// note_alloc(self, sz, site, frame, stack)
+//    Count an allocation of `sz` bytes at `site` in `self`'s statistics
+//    and, if it is sampled, in its heavy hitter counters. Sets `*stack` to
+//    the stack above `frame` if the allocation is sampled and stacks are
+//    captured, or to 0. Returns true if the allocation was sampled.
+
+static bool note_alloc(m61_thread* self, size_t sz, unsigned site, void* frame, unsigned* stack)
+{
+    bool sampled = true;
+    if (sample_rate)
+    {
+        self->sample_left -= sz;
+        sampled = self->sample_left <= 0;
+        if (sampled)
+        {
+            sample_next(self);
+        }
+    }
+
+    stat_add(self->stats.ntotal, 1);
+    stat_add(self->stats.total_size, sz);
+    stat_add(self->stats.nactive, 1);
+    stat_add(self->stats.active_size, sz);
+
+    *stack = 0;
+    if (sampled)
+    {
+        // sample_next just stepped the generator; its output, scrambled,
+        // rounds the weights
+        unsigned long long bytes, count;
+        sample_weight(sz, self->rng * 0x2545f4914f6cdd1dULL, &bytes, &count);
+        m61_hh_counts &counts = hh_counts(self->sites, site);
+        stat_add(counts.bytes, bytes);
+        stat_add(counts.count, count);
+        if (stack_depth)
+        {
+            *stack = stack_capture(self, site, frame);
+            m61_hh_counts &stack_counts = hh_counts(self->stacks, *stack);
+            stat_add(stack_counts.bytes, bytes);
+            stat_add(stack_counts.count, count);
+        }
+    }
+    return sampled;
+}
+
+// block_end(hdr)
+//    Return the end of the memory holding block `hdr`, which its data and
+//    trailing redzone may grow into.
+
+static uintptr_t block_end(m61_header* hdr)
+{
+    uintptr_t start = (uintptr_t) hdr - rz_left;
+    if (hdr->cls < nclasses)
+    {
+        return start + slab_stride[hdr->cls];
+    }
+    // find, not operator[], which could insert under a shared lock
+    std::shared_lock<std::shared_mutex> guard(regions_lock);
+    auto it = regions.find(start);
+    assert(it != regions.end());
+    return start + it->second.size;
+}
+
+// block_reserved(hdr)
+//    Return the bytes set aside for block `hdr` apart from its header: the
+//    rest of its slot, or for a large block the rest of its region and,
+//    if it is mapped, of its last page. Only a large block resized in
+//    place or over-aligned needs the address index to find its region's
+//    end.
+
+static size_t block_reserved(m61_header* hdr)
+{
+    if (hdr->cls < nclasses)
+    {
+        return slab_stride[hdr->cls] - sizeof(m61_header);
+    }
+    uintptr_t start = (uintptr_t) hdr - rz_left;
+    uintptr_t end;
+    if (hdr->flags & hdr_resized)
+    {
+        end = block_end(hdr);
+    }
+    else if (hdr->cls == cls_mmap)
+    {
+        end = start + mmap_body(hdr->sz);
+    }
+    else
+    {
+        end = start + rz_left + sizeof(m61_header) + hdr->sz + rz_right;
+    }
+    if (hdr->cls == cls_mmap)
+    {
+        end = (end + page_size - 1) & -page_size;
+    }
+    return end - start - sizeof(m61_header);
+}
+
+// live_add(self, hdr, sign)
+//    Add (if `sign` is 1) or remove (if -1) block `hdr` from `self`'s
+//    counters of active blocks: those of its size class, the change in
+//    active bytes behind active_peak, and its site's live counters if it
+//    is sampled. A large block must still be in the address index.
+
+static inline void live_add(m61_thread* self, m61_header* hdr, long long sign)
+{
+    m61_class_counters &cc = self->stats.classes[hdr->cls];
+    stat_add(cc.nactive, sign);
+    stat_add(cc.active_size, sign * hdr->sz);
+    stat_add(cc.reserved_size, sign * block_reserved(hdr));
+    self->active_delta += sign * (long long) hdr->sz;
+    self->active_high = std::max(self->active_high, self->active_delta);
+    if (self->active_delta >= peak_slack || self->active_delta <= -peak_slack)
+    {
+        active_flush(self);
+    }
+    if (hdr->flags & hdr_sampled)
+    {
+        // rounded by the block's address, so freeing the block subtracts
+        // exactly what allocating it added
+        unsigned long long bytes, count;
+        sample_weight(hdr->sz, (uintptr_t) hdr * 0x9e3779b97f4a7c15ULL, &bytes, &count);
+        m61_hh_counts &counts = hh_counts(self->sites, hdr->site);
+        stat_add(counts.live_bytes, sign * bytes);
+        stat_add(counts.live_count, sign * count);
+    }
+}
+
+// redzone_fill(hdr, sz)
+//    Fill the redzones of block `hdr`, whose data is `sz` bytes, with trm.
+
+static inline void redzone_fill(m61_header* hdr, size_t sz)
+{
+    char *data = (char *) (hdr + 1);
+    data[sz] = trm;
+    if (shadow_on)
+    {
+        memset((char *) hdr - rz_left, trm, rz_left);
+        memset(data + sz, trm, rz_right);
+    }
+}
+
+// redzone_intact(hdr)
+//    Return true if the redzones of block `hdr` still hold only trm.
+
+static inline bool redzone_intact(m61_header* hdr)
+{
+    const char *data = (const char *) (hdr + 1);
+    if (data[hdr->sz] != trm)
+    {
+        return false;
+    }
+    else if (shadow_on)
+    {
+        const char *left = (const char *) hdr - rz_left;
+        for (size_t i = 0; i != rz_left; ++i)
+        {
+            if (left[i] != trm)
+            {
+                return false;
+            }
+        }
+        for (size_t i = 1; i != rz_right; ++i)
+        {
+            if (data[hdr->sz + i] != trm)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// shadow_block(hdr)
+//    Mark the data of live block `hdr` addressable in the shadow map, and
+//    the rest of its memory as redzone.
+
+static void shadow_block(m61_header* hdr)
+{
+    uintptr_t start = (uintptr_t) hdr - rz_left;
+    uintptr_t data = (uintptr_t) (hdr + 1);
+    uintptr_t data_end = data + hdr->sz;
+    uintptr_t end = (block_end(hdr) + 7) & -8;
+    shadow_set(start, data, shadow_left);
+    shadow_set(data, data_end & -8, 0);
+    if (data_end & 7)
+    {
+        uintptr_t granule = data_end & -8;
+        shadow_set(granule, granule + 8, data_end & 7);
+        data_end = granule + 8;
+    }
+    shadow_set(data_end, end, shadow_right);
+}
+
+// redzone_sweep(file, line)
+//    Check the redzones of every live block, reporting the first damaged
+//    one as found by the allocation at `file`:`line`.
+
+static void redzone_sweep(const char* file, long line)
+{
+    std::unique_lock<std::shared_mutex> sweep_guard(sweep_lock);
+    std::shared_lock<std::shared_mutex> guard(regions_lock);
+    for (auto &it: regions)
+    {
+        size_t stride = it.second.stride ? it.second.stride : it.second.size;
+        for (uintptr_t slot = it.first; slot + stride <= it.first + it.second.size; slot += stride)
+        {
+            m61_header *hdr = (m61_header *) (slot + rz_left);
+            if (__atomic_load_n(&hdr->canary, __ATOMIC_ACQUIRE) == (hdr_live ^ (uintptr_t) hdr)
+                && !redzone_intact(hdr))
+            {
+                fprintf(stderr, "MEMORY BUG: %s:%li: redzone sweep detected wild write around pointer %p\n",
+                        file, line, (void *) (hdr + 1));
+                const m61_site &allocated = site_get(hdr->site);
+                fprintf(stderr, "   %s:%li: %p was allocated here\n", allocated.file, allocated.line,
+                        (void *) (hdr + 1));
+                abort();
+            }
+        }
+    }
+}
+
+// history_find(ptr, copy)
+//    Copy the latest free of `ptr` any thread's free history remembers into
+//    `*copy` and return true, or return false if none does. Only called
+//    on the way to abort(), so it reads other threads' rings without
+//    synchronization.
+
+static bool history_find(void* ptr, m61_freed* copy)
+{
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (m61_thread *t = threads; t; t = t->next)
+    {
+        for (unsigned i = 1; t->history && i <= history_size; ++i)
+        {
+            const m61_freed &f = t->history[(t->history_pos + history_size - i) % history_size];
+            if (f.ptr == (uintptr_t) ptr)
+            {
+                *copy = f;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// report_history(ptr)
+//    Print where `ptr` was allocated and last freed, if a thread's free
+//    history still remembers it.
+
+static void report_history(void* ptr)
+{
+    m61_freed f;
+    if (history_find(ptr, &f))
+    {
+        const m61_site &freed = site_get(f.free_site), &allocated = site_get(f.site);
+        fprintf(stderr, "   %s:%li: %p was freed here\n", freed.file, freed.line, ptr);
+        fprintf(stderr, "   %s:%li: %p (%zu bytes) was allocated here\n",
+                allocated.file, allocated.line, ptr, f.sz);
+    }
+}
+
+// check_block(ptr, file, line, op)
+//    Return the header of the live block `ptr`, which was passed to `op`
+//    at `file`:`line`. Reports a memory bug and aborts if `ptr` is not a
+//    live block or its terminator was overwritten.
+
+static m61_header* check_block(void* ptr, const char* file, long line, const char* op)
+{
+    if ((uintptr_t) ptr < heap_min.load(std::memory_order_relaxed)
+        || (uintptr_t) ptr > heap_max.load(std::memory_order_relaxed))
+    {
+        fprintf(stderr, "MEMORY BUG: %s:%li: invalid %s of pointer %p, not in heap\n", file, line, op, ptr);
+        abort();
+    }
+
+    // every block we hand out is max_align_t aligned, so a misaligned
+    // pointer cannot be ours and its "header" is not worth reading; the
+    // heap bounds span gaps between mappings, so neither is a header
+    // outside every region, which may be unmapped. A freed large block
+    // leaves the index, so it is recognized from the free history
+    m61_header *hdr = (m61_header *) ptr - 1;
+    uintptr_t canary = 0;
+    m61_freed freed;
+    if ((uintptr_t) ptr % alignof(std::max_align_t) == 0)
+    {
+        if (region_holds(thread_self(), (uintptr_t) hdr, sizeof(m61_header)))
+        {
+            canary = __atomic_load_n(&hdr->canary, __ATOMIC_RELAXED);
+        }
+        else if (history_find(ptr, &freed))
+        {
+            canary = hdr_freed ^ (uintptr_t) hdr;
+        }
+    }
+    if (canary == (hdr_freed ^ (uintptr_t) hdr))
+    {
+        fprintf(stderr, "MEMORY BUG: %s:%li: invalid %s of pointer %p, double free\n", file, line, op, ptr);
+        report_history(ptr);
+        abort();
+    }
+    else if (canary != (hdr_live ^ (uintptr_t) hdr))
+    {
+        fprintf(stderr, "MEMORY BUG: %s:%li: invalid %s of pointer %p, not allocated\n", file, line, op, ptr);
+        // check if ptr is between an active block's start and start + sz
+        m61_header enc;
+        if (uintptr_t start = find_enclosing(ptr, &enc))
+        {
+            fprintf(
+                stderr,
+                "   %s:%li: %p is %li bytes inside a %li byte region allocated here\n",
+                site_get(enc.site).file,
+                site_get(enc.site).line,
+                ptr,
+                (uintptr_t) ptr - start,
+                enc.sz
+            );
+        }
+        else
+        {
+            report_history(ptr);
+        }
+        abort();
+    }
+    else if (!redzone_intact(hdr))
+    {
+        fprintf(stderr, "MEMORY BUG: %s:%li: detected wild write during %s of pointer %p\n", file, line, op, ptr);
+        abort();
+    }
+    return hdr;
+}
+
+
+// malloc_aligned(align, sz, file, line, frame)
+//    Allocate `sz` bytes aligned to `align` (a power of 2) for the m61
+//    entry point whose frame is `frame`, called at `file`:`line`.
+
+static inline __attribute__((always_inline))
+void* malloc_aligned(size_t align, size_t sz, const char* file, long line, void* frame)
+{
+    m61_thread *self = thread_self();
+    uint64_t start = lat_begin(self, lat_malloc);
+    if (sweep_every && --self->sweep_left == 0)
+    {
+        self->sweep_left = sweep_every;
+        redzone_sweep(file, line);
+    }
+    std::shared_lock<std::shared_mutex> sweep_guard(sweep_lock, std::defer_lock);
+    if (sweep_every)
+    {
+        sweep_guard.lock();
+    }
+    m61_header *hdr = nullptr;
+    if (sz <= SIZE_MAX - rz_left - sizeof(m61_header) - rz_right - align)
+    {
+        hdr = block_alloc(self, sz, align);
+    }
+    if (!hdr)
+    {
+        stat_add(self->stats.nfail, 1);
+        stat_add(self->stats.fail_size, sz);
+        lat_end(self, lat_malloc, start);
+        return nullptr;
+    }
+
+    unsigned site = site_intern(self, file, line), stack;
+    bool sampled = note_alloc(self, sz, site, frame, &stack);
+    void *ptr = (void *) (hdr + 1);
+    hdr->sz = sz;
+    hdr->site = site;
+    hdr->stack = stack;
+    hdr->flags = sampled ? hdr_sampled : 0;
+    if (hdr->cls >= nclasses && align > alignof(std::max_align_t))
+    {
+        hdr->flags |= hdr_resized;
+    }
+    live_add(self, hdr, 1);
+    redzone_fill(hdr, sz);
+    if (shadow_on)
+    {
+        shadow_block(hdr);
+    }
+    // release so a redzone sweep that sees the block live sees its redzones
+    __atomic_store_n(&hdr->canary, hdr_live ^ (uintptr_t) hdr, __ATOMIC_RELEASE);
+    if (sampled)
+    {
+        active_link(hdr);
+    }
+    trace_record(self, m61_trace_malloc, ptr, nullptr, sz, site);
+
+    lat_end(self, lat_malloc, start);
+    return ptr;
+}
+
+
+/// m61_malloc(sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory.
+///    The memory is not initialized. If `sz == 0`, then m61_malloc must
+///    return a unique, newly-allocated pointer value. The allocation
+///    request was at location `file`:`line`.
+
+void* m61_malloc(size_t sz, const char* file, long line) {
+    return malloc_aligned(alignof(std::max_align_t), sz, file, line, __builtin_frame_address(0));
+}
+
+
+/// m61_aligned_alloc(align, sz, file, line)
+///    Like m61_malloc, but the returned pointer is a multiple of `align`,
+///    which must be a power of 2; otherwise the allocation fails. The
+///    block is checked and reported like any other. Alignments up to
+///    slab_align come from the slabs; larger ones cost up to `align`
+///    extra bytes.
+
+void* m61_aligned_alloc(size_t align, size_t sz, const char* file, long line) {
+    if (align == 0 || (align & (align - 1)) != 0)
+    {
+        m61_thread *self = thread_self();
+        stat_add(self->stats.nfail, 1);
+        stat_add(self->stats.fail_size, sz);
+        return nullptr;
+    }
+    align = std::max(align, alignof(std::max_align_t));
+    return malloc_aligned(align, sz, file, line, __builtin_frame_address(0));
+}
+
+
+/// m61_memalign(align, sz, file, line)
+///    Like m61_aligned_alloc, but as the C library's memalign, an
+///    `align` that is not a power of 2 is rounded up to one.
+
+void* m61_memalign(size_t align, size_t sz, const char* file, long line) {
+    size_t a = alignof(std::max_align_t);
+    while (a < align && a != 0)
+    {
+        a <<= 1;
+    }
+    if (a == 0)
+    {
+        m61_thread *self = thread_self();
+        stat_add(self->stats.nfail, 1);
+        stat_add(self->stats.fail_size, sz);
+        return nullptr;
+    }
+    return malloc_aligned(a, sz, file, line, __builtin_frame_address(0));
+}
+
+
+/// m61_free(ptr, file, line)
+///    Free the memory space pointed to by `ptr`, which must have been
+///    returned by a previous call to m61_malloc. If `ptr == NULL`,
+///    does nothing. The free was called at location `file`:`line`.
+
+void m61_free(void* ptr, const char* file, long line) {
+    (void) file, (void) line;   // avoid uninitialized variable warnings
+    if (!ptr)
+    {
+        return;
+    }
+    m61_thread *self = thread_self();
+    uint64_t start = lat_begin(self, lat_free);
+    std::shared_lock<std::shared_mutex> sweep_guard(sweep_lock, std::defer_lock);
+    if (sweep_every)
+    {
+        sweep_guard.lock();
+    }
+    m61_header *hdr = check_block(ptr, file, line, "free");
+    uintptr_t canary = hdr_live ^ (uintptr_t) hdr;
+    if (!__atomic_compare_exchange_n(&hdr->canary, &canary, hdr_freed ^ (uintptr_t) hdr,
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        // lost a race with another free of the same block
+        fprintf(stderr, "MEMORY BUG: %s:%li: invalid free of pointer %p, double free\n", file, line, ptr);
+        report_history(ptr);
+        abort();
+    }
+    unsigned free_site = 0;
+    if (self->history || quarantine_max || self->trace_buf)
+    {
+        free_site = site_intern(self, file, line);
+    }
+    trace_record(self, m61_trace_free, ptr, nullptr, 0, free_site);
+    if (self->history)
+    {
+        self->history[self->history_pos] = {(uintptr_t) ptr, hdr->sz, hdr->site, free_site};
+        if (++self->history_pos == history_size)
+        {
+            self->history_pos = 0;
+        }
+    }
+
+    size_t sz = hdr->sz;
+    live_add(self, hdr, -1);
+    if (hdr->flags & hdr_sampled)
+    {
+        active_unlink(hdr);
+    }
+    bool quarantined = quarantine_max && hdr->cls != cls_mmap;
+    if (shadow_on && (quarantined || hdr->cls < nclasses))
+    {
+        shadow_set((uintptr_t) ptr, block_end(hdr), shadow_freed);
+    }
+    if (quarantined)
+    {
+        memset(ptr, qpoison, sz);
+        self->quarantine.push_back({hdr, free_site});
+        self->quarantine_size += sizeof(m61_header) + sz;
+        quarantine_release(self, quarantine_max);
+    }
+    else
+    {
+        block_free(self, hdr);
+    }
+    stat_add(self->stats.nactive, -1);
+    stat_add(self->stats.active_size, -sz);
+    lat_end(self, lat_free, start);
+}
+
+
+/// m61_calloc(nmemb, sz, file, line)
+///    Return a pointer to newly-allocated dynamic memory big enough to
+///    hold an array of `nmemb` elements of `sz` bytes each. If `sz == 0`,
+///    then must return a unique, newly-allocated pointer value. Returned
+///    memory should be initialized to zero. The allocation request was at
+///    location `file`:`line`.
+
+void* m61_calloc(size_t nmemb, size_t sz, const char* file, long line) {
+    size_t toverflow = nmemb * sz;
+    if (nmemb != 0 && toverflow / nmemb != sz)
+    {
+        stat_add(thread_self()->stats.nfail, 1);
+        return nullptr;
+    }
+    // allocate from this frame, so stacks start at our caller
+    void* ptr = malloc_aligned(alignof(std::max_align_t), nmemb * sz, file, line,
+                               __builtin_frame_address(0));
+    if (ptr) {
+        memset(ptr, 0, nmemb * sz);
+    }
+    return ptr;
+}
+
+/// m61_realloc(ptr, sz, file, line)
+///    Reallocate the dynamic memory pointed to by `ptr` to hold at least
+///    `sz` bytes, returning a pointer to the new block. If `ptr` is
+///    `nullptr`, behaves like `m61_malloc(sz, file, line)`. If `sz` is 0,
+///    behaves like `m61_free(ptr, file, line)`. The allocation request
+///    was at location `file`:`line`. Shrinks and small growths keep the
+///    block in place; otherwise at most min(old, `sz`) bytes are copied.
+
+void* m61_realloc(void* ptr, size_t sz, const char* file, long line)
+{
+    if (!ptr)
+    {
+        return malloc_aligned(alignof(std::max_align_t), sz, file, line,
+                              __builtin_frame_address(0));
+    }
+    else if (sz == 0)
+    {
+        m61_free(ptr, file, line);
+        return nullptr;
+    }
+
+    m61_thread *self = thread_self();
+    uint64_t start = lat_begin(self, lat_realloc);
+    m61_header *hdr = check_block(ptr, file, line, "realloc");
+    size_t old_sz = hdr->sz;
+    stat_add(self->stats.nrealloc, 1);
+
+    // shrink, or grow into the block's slack, without moving; this counts
+    // as freeing the old block and allocating the new one at this site.
+    // with redzones, blocks only shrink in place: a redzone sweep could
+    // otherwise see the new size before the moved trailing redzone
+    if (sz <= old_sz
+        || (!shadow_on && sz < SIZE_MAX - rz_right
+            && sz + rz_right <= block_end(hdr) - (uintptr_t) ptr))
+    {
+        unsigned site = site_intern(self, file, line), stack;
+        bool sampled = note_alloc(self, sz, site, __builtin_frame_address(0), &stack);
+        stat_add(self->stats.nactive, -1);
+        stat_add(self->stats.active_size, -old_sz);
+        stat_add(self->stats.nrealloc_inplace, 1);
+        redzone_fill(hdr, sz);
+        // the new allocation is sampled afresh, so the block may join or
+        // leave the active list; off it while its fields change
+        live_add(self, hdr, -1);
+        if (hdr->flags & hdr_sampled)
+        {
+            active_unlink(hdr);
+        }
+        hdr->sz = sz;
+        hdr->site = site;
+        hdr->stack = stack;
+        hdr->flags = (hdr->flags & ~hdr_sampled) | (sampled ? hdr_sampled : 0);
+        if (hdr->cls >= nclasses)
+        {
+            hdr->flags |= hdr_resized;
+        }
+        live_add(self, hdr, 1);
+        if (sampled)
+        {
+            active_link(hdr);
+        }
+        if (shadow_on)
+        {
+            shadow_block(hdr);
+        }
+        trace_record(self, m61_trace_realloc, ptr, ptr, sz, site);
+        lat_end(self, lat_realloc, start);
+        return ptr;
+    }
+
+    // mmap blocks grow by remapping, which moves pages rather than bytes
+    if (hdr->cls == cls_mmap && !shadow_on)
+    {
+        bool sampled = hdr->flags & hdr_sampled;
+        if (sampled)
+        {
+            active_unlink(hdr);
+        }
+        // uncount the block while its region is still indexed; on failure
+        // it is counted again as it was
+        live_add(self, hdr, -1);
+        m61_header *new_hdr = mmap_grow(hdr, sz);
+        if (new_hdr)
+        {
+            unsigned site = site_intern(self, file, line), stack;
+            sampled = note_alloc(self, sz, site, __builtin_frame_address(0), &stack);
+            stat_add(self->stats.nactive, -1);
+            stat_add(self->stats.active_size, -old_sz);
+            if (new_hdr == hdr)
+            {
+                stat_add(self->stats.nrealloc_inplace, 1);
+            }
+            // the block's region now fits its size exactly
+            hdr = new_hdr;
+            hdr->sz = sz;
+            hdr->site = site;
+            hdr->stack = stack;
+            hdr->flags = sampled ? hdr_sampled : 0;
+            redzone_fill(hdr, sz);
+        }
+        live_add(self, hdr, 1);
+        if (sampled)
+        {
+            active_link(hdr);
+        }
+        if (new_hdr)
+        {
+            trace_record(self, m61_trace_realloc, hdr + 1, ptr, sz, hdr->site);
+            lat_end(self, lat_realloc, start);
+            return (void *) (hdr + 1);
+        }
+    }
+
+    // on failure the old block is left alone
+    void *new_ptr = malloc_aligned(alignof(std::max_align_t), sz, file, line,
+                                   __builtin_frame_address(0));
+    if (new_ptr)
+    {
+        memcpy(new_ptr, ptr, std::min(old_sz, sz));
+        m61_free(ptr, file, line);
+    }
+    lat_end(self, lat_realloc, start);
+    return new_ptr;
+}
+
+
+/// m61_check_access(ptr, len, file, line)
+///    Check that the `len` bytes at `ptr` may be accessed, reporting a
+///    memory bug and aborting if any is in a redzone or in a freed block.
+///    The check was requested at location `file`:`line`. Does nothing
+///    unless redzones are on (M61_REDZONE).
+
+void m61_check_access(const void* ptr, size_t len, const char* file, long line) {
+    if (!shadow_on)
+    {
+        return;
+    }
+    uintptr_t end = (uintptr_t) ptr + len;
+    for (uintptr_t addr = (uintptr_t) ptr; addr < end; addr = (addr & -8) + 8)
+    {
+        // granule bytes [0, shadow) are addressable for 0 < shadow < 8
+        unsigned char shadow = shadow_get(addr);
+        uintptr_t granule = addr & -8;
+        if (shadow == 0 || (shadow < 8 && std::min(end, granule + 8) <= granule + shadow))
+        {
+            continue;
+        }
+
+        uintptr_t bad = shadow < 8 ? std::max(addr, granule + shadow) : addr;
+        fprintf(stderr, "MEMORY BUG: %s:%li: invalid access to %p (%zu bytes), %s\n",
+                file, line, (void *) bad, len, shadow == shadow_freed ? "freed memory" : "redzone");
+        m61_header copy;
+        if (m61_header *hdr = find_slot(bad, &copy))
+        {
+            uintptr_t data = (uintptr_t) (hdr + 1);
+            const m61_site &allocated = site_get(copy.site);
+            if (bad < data)
+            {
+                fprintf(stderr, "   %s:%li: %p is %zu bytes before a %zu byte region allocated here\n",
+                        allocated.file, allocated.line, (void *) bad, data - bad, copy.sz);
+            }
+            else if (bad >= data + copy.sz)
+            {
+                fprintf(stderr, "   %s:%li: %p is %zu bytes past the end of a %zu byte region allocated here\n",
+                        allocated.file, allocated.line, (void *) bad, bad - data - copy.sz, copy.sz);
+            }
+            else
+            {
+                fprintf(stderr, "   %s:%li: %p is %zu bytes inside a %zu byte region allocated here\n",
+                        allocated.file, allocated.line, (void *) bad, bad - data, copy.sz);
+            }
+        }
+        abort();
+    }
+}
+
+
+/// m61_usable_size(ptr, file, line)
+///    Return the size of the active block at `ptr`, which must have been
+///    returned by m61_malloc. Writing past that size is a wild write,
+///    however much slack the block has. The query was at location
+///    `file`:`line`.
+
+size_t m61_usable_size(void* ptr, const char* file, long line) {
+    return check_block(ptr, file, line, "size query")->sz;
+}
+
+
+/// m61_arena::m61_arena(tag, chunk)
+///    Create an empty arena that allocates `chunk`-byte chunks at call
+///    site `tag`.
+
+m61_arena::m61_arena(const char* tag, size_t chunk) noexcept
+    : name(tag), chunk_size(chunk) {
+}
+
+m61_arena::~m61_arena() {
+    release();
+}
+
+
+/// m61_arena::allocate(sz, align)
+///    Return `sz` bytes from the arena aligned to `align`, or nullptr if
+///    out of memory. Requests over a quarter of a chunk get a chunk of
+///    their own, so they neither waste the rest of the current chunk nor
+///    make it too small. Chunks are only max_align_t-aligned, so a new
+///    chunk is over-allocated by any larger `align` and the first object
+///    is rounded up within it.
+
+void* m61_arena::allocate(size_t sz, size_t align) {
+    assert(align != 0 && (align & (align - 1)) == 0);
+    uintptr_t p = ((uintptr_t) next + align - 1) & -align;
+    if (next && p <= (uintptr_t) end && sz <= (uintptr_t) end - p)
+    {
+        next = (char *) (p + sz);
+        return (void *) p;
+    }
+
+    // a chunk starts with its link, padded to keep the rest aligned
+    const size_t link = alignof(std::max_align_t);
+    size_t pad = align > link ? align - link : 0;
+    if (sz > SIZE_MAX - link - pad)
+    {
+        return nullptr;
+    }
+    bool own = sz + pad > chunk_size / 4;
+    size_t body = own ? sz + pad : chunk_size;
+    char *chunk = (char *) m61_malloc(link + body, name, 0);
+    if (!chunk)
+    {
+        return nullptr;
+    }
+    *(void **) chunk = chunks;
+    chunks = chunk;
+    p = ((uintptr_t) chunk + link + align - 1) & -align;
+    if (!own)
+    {
+        next = (char *) (p + sz);
+        end = chunk + link + body;
+    }
+    return (void *) p;
+}
+
+
+/// m61_arena::release()
+///    Free every chunk of the arena.
+
+void m61_arena::release() {
+    while (void *chunk = chunks)
+    {
+        chunks = *(void **) chunk;
+        m61_free(chunk, name, 0);
+    }
+    next = end = nullptr;
+}
+
+
+// slab_scan(stats)
+//    Set `stats->free_size` to the bytes in free slab slots (slots in
+//    quarantine included) and `stats->largest_free` to the bytes in the
+//    longest run of adjacent free slots. Slots are read while other
+//    threads allocate, so the result is a snapshot only.
+
+static_assert(nclasses + 2 == m61_nclasses, "m61_nclasses must match the slab classes");
+
+static void slab_scan(m61_statistics* stats)
+{
+    // slabs are only ever pushed on the list, and every slab older than
+    // a depot's bump pointer has been carved up to its end
+    m61_slab *slabs;
+    {
+        std::lock_guard<std::mutex> guard(slab_list_lock);
+        slabs = slab_list;
+    }
+    char *bump[nclasses];
+    for (unsigned cls = 0; cls != nclasses; ++cls)
+    {
+        std::lock_guard<std::mutex> guard(depots[cls].lock);
+        bump[cls] = depots[cls].bump;
+    }
+
+    stats->free_size = stats->largest_free = 0;
+    for (m61_slab *slab = slabs; slab; slab = slab->next)
+    {
+        size_t stride = slab_stride[slab->cls];
+        size_t size = stride - sizeof(m61_header);
+        char *end;
+        char *slot = slab_slots(slab, &end);
+        char *carved = bump[slab->cls] >= slot && bump[slab->cls] < end ? bump[slab->cls] : end;
+        unsigned long long run = 0;
+        for (; slot != end; slot += stride)
+        {
+            m61_header *hdr = (m61_header *) (slot + rz_left);
+            if (slot < carved
+                && __atomic_load_n(&hdr->canary, __ATOMIC_RELAXED) == (hdr_live ^ (uintptr_t) hdr))
+            {
+                run = 0;
+                continue;
+            }
+            run += size;
+            stats->free_size += size;
+            stats->largest_free = std::max(stats->largest_free, run);
+        }
+    }
+}
+
+
+/// m61_get_statistics(stats)
+///    Store the current memory statistics in `*stats`.
+
+void m61_get_statistics(m61_statistics* stats) {
+    // sum the per-thread shares; individual shares may have wrapped, but
+    // unsigned arithmetic makes the total come out right
+    m61_statistics total;
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        memset(&total, 0, sizeof(total));
+        for (m61_thread *t = &retired; t; t = (t == &retired ? threads : t->next))
+        {
+            total.nactive += t->stats.nactive;
+            total.active_size += t->stats.active_size;
+            total.ntotal += t->stats.ntotal;
+            total.total_size += t->stats.total_size;
+            total.nfail += t->stats.nfail;
+            total.fail_size += t->stats.fail_size;
+            total.nrealloc += t->stats.nrealloc;
+            total.nrealloc_inplace += t->stats.nrealloc_inplace;
+            for (unsigned cls = 0; cls != nclasses + 2; ++cls)
+            {
+                total.classes[cls].nactive += t->stats.classes[cls].nactive;
+                total.classes[cls].active_size += t->stats.classes[cls].active_size;
+                total.classes[cls].reserved_size += t->stats.classes[cls].reserved_size;
+            }
+        }
+    }
+    *stats = total;
+    stats->heap_min = heap_max.load() ? heap_min.load() : 0;
+    stats->heap_max = heap_max.load();
+
+    active_flush(thread_self());
+    stats->peak_active_size = std::max((unsigned long long) active_peak.load(), stats->active_size);
+    stats->metadata_size = meta_size.load();
+    for (unsigned cls = 0; cls != nclasses + 2; ++cls)
+    {
+        stats->classes[cls].size = cls < nclasses ? slab_stride[cls] - sizeof(m61_header) : 0;
+        stats->reserved_size += stats->classes[cls].reserved_size;
+    }
+    // large blocks' headers are not counted in meta_size
+    stats->metadata_size += (stats->classes[cls_base].nactive + stats->classes[cls_mmap].nactive)
+        * sizeof(m61_header);
+    slab_scan(stats);
+}
+
+
+// report_out()
+//    Return the stream reports print to.
+
+static FILE* report_out()
+{
+    return report_file ? report_file : stdout;
+}
+
+
+/// m61_set_report_file(f)
+///    Print reports to `f` instead of stdout; nullptr restores stdout.
+
+void m61_set_report_file(FILE* f) {
+    report_file = f;
+}
+
+
+/// m61_print_statistics()
+///    Print the current memory statistics.
+
+void m61_print_statistics() {
+    m61_statistics stats;
+    m61_get_statistics(&stats);
+
+    fprintf(
+        report_out(),
+        "alloc count: active %10llu   total %10llu   fail %10llu\n",
+        stats.nactive, stats.ntotal, stats.nfail
+    );
+    fprintf(
+        report_out(),
+        "alloc size:  active %10llu   total %10llu   fail %10llu\n",
+        stats.active_size, stats.total_size, stats.fail_size
+    );
+}
+
+
+// reports are written in chunks of about this many bytes
+const size_t report_chunk = 1 << 20;
+
+// leak_site
+//    Leaked blocks from one call site.
+
+struct leak_site
+{
+    unsigned long long count = 0;
+    unsigned long long size = 0;
+};
+
+// leak_object
+//    A leaked block, copied out of its active list shard so it can be
+//    printed without holding the shard's lock.
+
+struct leak_object
+{
+    void* ptr;
+    size_t size;
+    unsigned site;
+    unsigned stack;
+};
+
+// report_append(out, format, ...)
+//    Append printf-style output to `out`.
+
+static void report_append(std::string& out, const char* format, ...)
+{
+    char buf[512];
+    va_list val;
+    va_start(val, format);
+    int n = vsnprintf(buf, sizeof(buf), format, val);
+    va_end(val);
+    if (n >= (int) sizeof(buf))
+    {
+        size_t pos = out.size();
+        out.resize(pos + n + 1);
+        va_start(val, format);
+        vsnprintf(&out[pos], n + 1, format, val);
+        va_end(val);
+        out.resize(pos + n);
+    }
+    else if (n > 0)
+    {
+        out.append(buf, n);
+    }
+}
+
+// stack_append(out, stack, json)
+//    Append the frames of `stack` to `out`, one indented line each, or as
+//    a JSON array of addresses if `json`. Frames are named with dladdr,
+//    which only knows dynamic symbols (link with -rdynamic).
+
+static void stack_append(std::string& out, unsigned stack, bool json)
+{
+    const m61_stack &st = stack_get(stack);
+    for (unsigned i = 0; i != st.depth; ++i)
+    {
+        if (json)
+        {
+            report_append(out, "%s\"%#" PRIxPTR "\"", i ? "," : "", st.pcs[i]);
+            continue;
+        }
+        report_append(out, "   #%u %#" PRIxPTR, i, st.pcs[i]);
+        // look up the call instruction, which a return address is just past
+        Dl_info info;
+        if (dladdr((void *) (st.pcs[i] - 1), &info) && info.dli_sname)
+        {
+            report_append(out, " %s+%#" PRIxPTR, info.dli_sname, st.pcs[i] - (uintptr_t) info.dli_saddr);
+        }
+        out += '\n';
+    }
+}
+
+// report_append_number(out, n, base)
+//    Append the digits of `n` in `base` (at most 16) to `out`.
+
+static void report_append_number(std::string& out, unsigned long long n, unsigned base)
+{
+    char buf[64];
+    char *p = buf + sizeof(buf);
+    do
+    {
+        *--p = "0123456789abcdef"[n % base];
+        n /= base;
+    } while (n);
+    out.append(p, buf + sizeof(buf) - p);
+}
+
+// report_write(out)
+//    Write `out` to the report stream with as few system calls as
+//    possible, after anything already buffered in it.
+
+static void report_write(const std::string& out)
+{
+    FILE *f = report_out();
+    fflush(f);
+    int fd = fileno(f);
+    size_t pos = 0;
+    while (pos < out.size())
     {
-        float percent = (float) it_hhv->meta.count / l_stats.ntotal;
-        if (percent < limit)
+        ssize_t w = write(fd, out.data() + pos, out.size() - pos);
+        if (w < 0 && errno != EINTR && errno != EAGAIN)
         {
             break;
         }
+        pos += w > 0 ? w : 0;
+    }
+}
+
+
+/// m61_print_fragmentation_report()
+///    Print peak, reserved, free and metadata bytes, and internal and
+///    external fragmentation, overall and by size class. Internal
+///    fragmentation is the share of reserved bytes not requested;
+///    external fragmentation is the share of free slab bytes outside the
+///    longest run of free slots.
+
+void m61_print_fragmentation_report() {
+    m61_statistics stats;
+    m61_get_statistics(&stats);
+
+    fprintf(report_out(), "HEAP: %llu active bytes in %llu blocks, peak %llu bytes\n",
+           stats.active_size, stats.nactive, stats.peak_active_size);
+    fprintf(report_out(), "HEAP: %llu reserved bytes (%.1f%% internal fragmentation), %llu metadata bytes\n",
+           stats.reserved_size,
+           stats.reserved_size ? 100.0 - 100.0 * stats.active_size / stats.reserved_size : 0.0,
+           stats.metadata_size);
+    fprintf(report_out(), "HEAP: %llu free slab bytes, longest run %llu bytes (%.1f%% external fragmentation)\n",
+           stats.free_size, stats.largest_free,
+           stats.free_size ? 100.0 - 100.0 * stats.largest_free / stats.free_size : 0.0);
+    for (unsigned cls = 0; cls != nclasses + 2; ++cls)
+    {
+        const m61_class_statistics &cs = stats.classes[cls];
+        if (cs.nactive == 0)
+        {
+            continue;
+        }
+        char name[32];
+        if (cls < nclasses)
+        {
+            snprintf(name, sizeof(name), "%zu", cs.size);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%s", cls == cls_base ? "large" : "mmap");
+        }
+        fprintf(report_out(), "HEAP SIZE CLASS %s: %llu active, %llu requested bytes, %llu reserved bytes (%.1f%% internal fragmentation)\n",
+               name, cs.nactive, cs.active_size, cs.reserved_size,
+               100.0 - 100.0 * cs.active_size / cs.reserved_size);
+    }
+}
+
+
+/// m61_print_latency_report()
+///    Print latency histograms for the operations timed with
+///    M61_LATENCY_SAMPLE, and allocation counts by size class.
+
+void m61_print_latency_report() {
+    unsigned long long hist[lat_nops][lat_nbuckets] = {};
+    unsigned long long ticks[lat_nops] = {};
+    unsigned long long nclass[nclasses + 2] = {};
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        for (m61_thread *t = &retired; t; t = (t == &retired ? threads : t->next))
+        {
+            for (unsigned op = 0; op != lat_nops; ++op)
+            {
+                for (unsigned b = 0; b != lat_nbuckets; ++b)
+                {
+                    hist[op][b] += t->lat.hist[op][b];
+                }
+                ticks[op] += t->lat.ticks[op];
+            }
+            for (unsigned cls = 0; cls != nclasses + 2; ++cls)
+            {
+                nclass[cls] += t->lat.nclass[cls];
+            }
+        }
+    }
+
+    // calibrate the timer against the clock over the whole run
+    double ns_per_tick = 1;
+    if (uint64_t elapsed = lat_now() - lat_tick0)
+    {
+        ns_per_tick = (double) (lat_clock_ns() - lat_ns0) / elapsed;
+    }
+
+    for (unsigned op = 0; op != lat_nops; ++op)
+    {
+        unsigned long long n = 0;
+        for (unsigned b = 0; b != lat_nbuckets; ++b)
+        {
+            n += hist[op][b];
+        }
+        if (n == 0)
+        {
+            continue;
+        }
+
+        // percentiles are reported as the upper bound of their bucket
+        double p50 = 0, p99 = 0;
+        unsigned long long seen = 0;
+        for (unsigned b = 0; b != lat_nbuckets; ++b)
+        {
+            seen += hist[op][b];
+            double bound = ldexp(ns_per_tick, b + 1);
+            if (!p50 && seen * 2 >= n)
+            {
+                p50 = bound;
+            }
+            if (!p99 && seen * 100 >= n * 99)
+            {
+                p99 = bound;
+            }
+        }
+        fprintf(report_out(), "LATENCY %s: %llu timed, mean %.0f ns, p50 < %.0f ns, p99 < %.0f ns\n",
+               lat_op_names[op], n, ticks[op] * ns_per_tick / n, p50, p99);
+        for (unsigned b = 0; b != lat_nbuckets; ++b)
+        {
+            if (hist[op][b])
+            {
+                fprintf(report_out(), "LATENCY %s: %9.0f - %9.0f ns %12llu\n", lat_op_names[op],
+                       ldexp(ns_per_tick, b), ldexp(ns_per_tick, b + 1), hist[op][b]);
+            }
+        }
+    }
+
+    for (unsigned cls = 0; cls != nclasses + 2; ++cls)
+    {
+        if (nclass[cls] == 0)
+        {
+            continue;
+        }
+        else if (cls < nclasses)
+        {
+            fprintf(report_out(), "SIZE CLASS %zu: %llu allocations\n", slab_classes[cls], nclass[cls]);
+        }
+        else
+        {
+            fprintf(report_out(), "SIZE CLASS %s: %llu allocations\n", cls == cls_base ? "large" : "mmap",
+                   nclass[cls]);
+        }
+    }
+}
+
+
+/// m61_print_leak_report()
+///    Print a report of all currently-active allocated blocks of dynamic
+///    memory.
+
+void m61_print_leak_report() {
+    // M61_LEAK_REPORT selects the format: "objects" (the default) prints
+    // every leaked block, "grouped" totals them by call site, heaviest
+    // first, and "json" prints those totals as one JSON object per line.
+    // with stack traces on, each site is split by the stacks through it
+    const char *mode = getenv("M61_LEAK_REPORT");
+    bool grouped = mode && (strcmp(mode, "grouped") == 0 || strcmp(mode, "json") == 0);
+    bool json = mode && strcmp(mode, "json") == 0;
+
+    std::string out;
+    // leaks by site id, or by stack id if stacks are captured
+    std::vector<leak_site> sites;
+    // each shard's leaks are copied under its lock and printed after, so
+    // threads using the shard never wait on symbolization or output
+    std::vector<leak_object> objects;
+    for (auto &shard: active_shards)
+    {
+        {
+            std::lock_guard<m61_spinlock> guard(shard.lock);
+            for (m61_header *hdr = shard.head; hdr; hdr = hdr->next)
+            {
+                if (grouped)
+                {
+                    unsigned id = stack_depth ? hdr->stack : hdr->site;
+                    if (id >= sites.size())
+                    {
+                        sites.resize((stack_depth ? nstacks : nsites).load(std::memory_order_acquire));
+                    }
+                    leak_site &site = sites[id];
+                    ++site.count;
+                    site.size += hdr->sz;
+                }
+                else
+                {
+                    objects.push_back({hdr + 1, hdr->sz, hdr->site, hdr->stack});
+                }
+            }
+        }
+
+        for (const leak_object &leak: objects)
+        {
+            // formatted by hand: printf dominates reports with millions
+            // of leaks
+            const m61_site &allocated = site_get(leak.site);
+            out += "LEAK CHECK: ";
+            out += allocated.file;
+            out += ':';
+            report_append_number(out, allocated.line, 10);
+            out += ": allocated object 0x";
+            report_append_number(out, (uintptr_t) leak.ptr, 16);
+            out += " with size ";
+            report_append_number(out, leak.size, 10);
+            out += '\n';
+            stack_append(out, leak.stack, false);
+            if (out.size() >= report_chunk)
+            {
+                report_write(out);
+                out.clear();
+            }
+        }
+        objects.clear();
+    }
+
+    std::vector<unsigned> sorted;
+    for (unsigned id = 0; id != sites.size(); ++id)
+    {
+        if (sites[id].count)
+        {
+            sorted.push_back(id);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), [&](unsigned a, unsigned b) {
+                                                return sites[a].size > sites[b].size;
+                                            });
+    for (unsigned id: sorted)
+    {
+        const m61_site &allocated = site_get(stack_depth ? stack_get(id).site : id);
+        if (json)
+        {
+            out += "{\"file\":\"";
+            for (const char *p = allocated.file; *p; ++p)
+            {
+                if (*p == '"' || *p == '\\')
+                {
+                    out += '\\';
+                }
+                if ((unsigned char) *p < 0x20)
+                {
+                    report_append(out, "\\u%04x", *p);
+                }
+                else
+                {
+                    out += *p;
+                }
+            }
+            report_append(out, "\",\"line\":%li,\"count\":%llu,\"size\":%llu",
+                          allocated.line, sites[id].count, sites[id].size);
+            if (stack_depth)
+            {
+                out += ",\"stack\":[";
+                stack_append(out, id, true);
+                out += ']';
+            }
+            out += "}\n";
+        }
+        else
+        {
+            report_append(out, "LEAK CHECK: %s:%li: %llu objects with total size %llu\n",
+                          allocated.file, allocated.line, sites[id].count, sites[id].size);
+            if (stack_depth)
+            {
+                stack_append(out, id, false);
+            }
+        }
+    }
+    report_write(out);
+}
+
+
+// print_heavy_hitters(chunks, nchunks, field, total, format, stacks)
+//    Print every site (or stack, if `stacks`) whose `field` counter in
+//    `chunks` holds at least `limit` of `total`, heaviest first, with its
+//    share and, for stacks, its frames.
+
+static void print_heavy_hitters(const std::atomic<m61_hh_counts*>* chunks, unsigned nchunks,
+                                std::atomic<unsigned long long> m61_hh_counts::* field,
+                                unsigned long long total, const char* format, bool stacks)
+{
+    std::vector<std::pair<unsigned long long, unsigned>> hh_v;
+    for (unsigned c = 0; c != nchunks; ++c)
+    {
+        const m61_hh_counts *counts = chunks[c].load(std::memory_order_relaxed);
+        for (unsigned i = 0; counts && i != (1 << id_chunk_bits); ++i)
+        {
+            unsigned long long weight = (counts[i].*field).load(std::memory_order_relaxed);
+            if (weight && weight >= limit * total)
+            {
+                hh_v.push_back({weight, (c << id_chunk_bits) + i});
+            }
+        }
+    }
+    // ties go to the older site or stack, so reports are deterministic
+    std::sort(hh_v.begin(), hh_v.end(), [](const auto &a, const auto &b) {
+                                            return a.first > b.first
+                                                || (a.first == b.first && a.second < b.second);
+                                        });
+    std::string out;
+    for (auto &it: hh_v)
+    {
+        const m61_site &site = site_get(stacks ? stack_get(it.second).site : it.second);
+        report_append(out, format, site.file, site.line, it.first, (float) it.first / total * 100);
+        if (stacks)
+        {
+            stack_append(out, it.second, false);
+        }
+    }
+    fputs(out.c_str(), report_out());
+}
+
+
+/// m61_print_heavy_hitter_report()
+///    Print a report of heavily-used allocation locations, then, if stack
+///    traces are captured, of heavily-used allocation stacks.
+
+void m61_print_heavy_hitter_report() {
+    // sum every thread's per-site counters; counters are read while
+    // their threads keep allocating, so the report is a snapshot only
+    m61_thread *total = new m61_thread();
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        thread_fold(total, &retired);
+        for (m61_thread *t = threads; t; t = t->next)
+        {
+            thread_fold(total, t);
+        }
+    }
+    unsigned long long total_size = total->stats.total_size.load();
+    unsigned long long ntotal = total->stats.ntotal.load();
+
+    // heavy hitters
+    print_heavy_hitters(total->sites, site_nchunks, &m61_hh_counts::bytes, total_size,
+                        "HEAVY HITTER: %s:%li: %llu bytes (~%.1f%%)\n", false);
+
+    // frequent allocations
+    print_heavy_hitters(total->sites, site_nchunks, &m61_hh_counts::count, ntotal,
+                        "FREQUENTLY ALLOCATED: %s:%li: %llu count (~%.1f%%)\n", false);
+
+    if (stack_depth)
+    {
+        print_heavy_hitters(total->stacks, stack_nchunks, &m61_hh_counts::bytes, total_size,
+                            "HEAVY HITTER STACK: %s:%li: %llu bytes (~%.1f%%)\n", true);
+        print_heavy_hitters(total->stacks, stack_nchunks, &m61_hh_counts::count, ntotal,
+                            "FREQUENTLY ALLOCATED STACK: %s:%li: %llu count (~%.1f%%)\n", true);
+    }
+    hh_free(total->sites, site_nchunks);
+    hh_free(total->stacks, stack_nchunks);
+    delete total;
+}
+
+
+// snapshot_add(snap, t)
+//    Add `t`'s live counters into `snap`.
+
+static void snapshot_add(m61_heap_snapshot* snap, const m61_thread* t)
+{
+    for (unsigned site = 0; site < snap->live.size(); site += 1 << id_chunk_bits)
+    {
+        const m61_hh_counts *counts = t->sites[site >> id_chunk_bits].load(std::memory_order_acquire);
+        for (unsigned i = 0; counts && i != (1 << id_chunk_bits) && site + i < snap->live.size(); ++i)
+        {
+            snap->live[site + i].first += counts[i].live_bytes.load(std::memory_order_relaxed);
+            snap->live[site + i].second += counts[i].live_count.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+
+/// m61_snapshot()
+///    Return a snapshot of the live bytes and blocks at every call site.
+
+m61_heap_snapshot* m61_snapshot() {
+    m61_heap_snapshot *snap = new m61_heap_snapshot;
+    std::lock_guard<std::mutex> guard(registry_lock);
+    snap->live.resize(nsites.load(std::memory_order_acquire));
+    snapshot_add(snap, &retired);
+    for (m61_thread *t = threads; t; t = t->next)
+    {
+        snapshot_add(snap, t);
+    }
+    return snap;
+}
+
+
+// snapshot_print_diff(f, a, b)
+//    Print the change from snapshot `a` (or an empty heap) to snapshot
+//    `b` to `f`.
+
+static void snapshot_print_diff(FILE* f, const m61_heap_snapshot* a, const m61_heap_snapshot* b)
+{
+    static const m61_heap_snapshot empty;
+    if (!a)
+    {
+        a = &empty;
+    }
+    long long bytes = 0, count = 0;
+    std::vector<std::pair<long long, unsigned>> grown;
+    for (unsigned site = 0; site < std::max(a->live.size(), b->live.size()); ++site)
+    {
+        auto before = site < a->live.size() ? a->live[site] : std::make_pair(0LL, 0LL);
+        auto after = site < b->live.size() ? b->live[site] : std::make_pair(0LL, 0LL);
+        bytes += after.first - before.first;
+        count += after.second - before.second;
+        if (after.first > before.first)
+        {
+            grown.push_back({after.first - before.first, site});
+        }
+    }
+    std::sort(grown.begin(), grown.end(), [](const auto &x, const auto &y) {
+                                              return x.first > y.first
+                                                  || (x.first == y.first && x.second < y.second);
+                                          });
+
+    fprintf(f, "SNAPSHOT DIFF: %+lld bytes, %+lld objects\n", bytes, count);
+    for (unsigned i = 0; i != std::min((size_t) snapshot_top, grown.size()); ++i)
+    {
+        unsigned site = grown[i].second;
+        const m61_site &allocated = site_get(site);
+        long long before = site < a->live.size() ? a->live[site].second : 0;
+        fprintf(f, "SNAPSHOT DIFF: %s:%li: %+lld bytes, %+lld objects, %lld live bytes\n",
+                allocated.file, allocated.line, grown[i].first,
+                b->live[site].second - before, b->live[site].first);
+    }
+}
+
+
+/// m61_snapshot_diff(a, b)
+///    Print how the heap changed from snapshot `a` to snapshot `b`.
+
+void m61_snapshot_diff(const m61_heap_snapshot* a, const m61_heap_snapshot* b) {
+    snapshot_print_diff(report_out(), a, b);
+}
 
-        fprintf(
-            stdout,
-            "FREQUENTLY ALLOCATED: %s:%li: %li count (~%.1f%%)\n",
-            it_hhv->call_meta.file,
-            it_hhv->call_meta.line,
-            it_hhv->meta.count,
-            percent * 100
-        );
 
-        it_hhv++;
+/// m61_snapshot_free(snap)
+///    Release a snapshot.
+
+void m61_snapshot_free(m61_heap_snapshot* snap) {
+    delete snap;
+}
+
+
+/// m61_trace_flush()
+///    Write the calling thread's buffered trace records.
+
+void m61_trace_flush() {
+    if (m61_thread *t = tls_thread)
+    {
+        if (t->trace_buf)
+        {
+            trace_flush(t);
+        }
     }
 }
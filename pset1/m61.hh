@@ -3,6 +3,7 @@
 #include <cassert>
 #include <cstdlib>
 #include <cinttypes>
+#include <cstddef>
 #include <cstdio>
 #include <new>
 
@@ -30,6 +31,34 @@ void* m61_calloc(size_t nmemb, size_t sz, const char* file, long line);
 
 void* m61_realloc(void* ptr, size_t sz, const char* file, long line);
 
+/// m61_aligned_alloc(align, sz, file, line)
+///    Return a pointer to `sz` bytes of newly-allocated dynamic memory
+///    aligned to `align`, which must be a power of 2. Set M61_CACHE_ALIGN=1
+///    in the environment to align every block to a 64-byte cache line, so
+///    that cache-line alignment costs no extra memory.
+void* m61_aligned_alloc(size_t align, size_t sz, const char* file, long line);
+
+/// m61_memalign(align, sz, file, line)
+///    Like m61_aligned_alloc, but rounds `align` up to a power of 2.
+void* m61_memalign(size_t align, size_t sz, const char* file, long line);
+
+
+/// m61_class_statistics
+///    Active blocks of one size class. Reserved bytes exclude headers but
+///    include redzones and the rest of each block's slot (or, for mapped
+///    blocks, the rest of its last page), so `reserved_size - active_size`
+///    is the class's internal fragmentation.
+struct m61_class_statistics {
+    size_t size;                        // slot size, or 0 for large blocks
+    unsigned long long nactive;         // # active allocations
+    unsigned long long active_size;     // # bytes requested by them
+    unsigned long long reserved_size;   // # bytes reserved for them
+};
+
+/// m61_nclasses
+///    Number of size classes: slab classes by size, then blocks from
+///    base_malloc, then blocks with their own mapping.
+const unsigned m61_nclasses = 10;
 
 /// m61_statistics
 ///    Structure tracking memory statistics.
@@ -40,27 +69,86 @@ struct m61_statistics {
     unsigned long long total_size;      // # bytes in total allocations
     unsigned long long nfail;           // # failed allocation attempts
     unsigned long long fail_size;       // # bytes in failed alloc attempts
+    unsigned long long nrealloc;        // # reallocs of existing blocks
+    unsigned long long nrealloc_inplace; // # of those that did not move
     uintptr_t heap_min;                 // smallest allocated addr
     uintptr_t heap_max;                 // largest allocated addr
+    unsigned long long peak_active_size; // largest active_size so far (*)
+    unsigned long long reserved_size;   // # bytes reserved for active allocations
+    unsigned long long free_size;       // # bytes in free slab slots
+    unsigned long long largest_free;    // # bytes in the longest run of adjacent free slab slots
+    unsigned long long metadata_size;   // # bytes of headers and allocator tables
+    m61_class_statistics classes[m61_nclasses];
+    // (*) exact for the calling thread; each other thread's allocations
+    // since it last crossed 64 KiB of change may be missed
 };
 
+/// m61_check_access(ptr, len, file, line)
+///    Check that the `len` bytes at `ptr` may be accessed. With redzones
+///    on (M61_REDZONE=N in the environment), reports accesses to redzones
+///    or freed blocks; otherwise does nothing.
+void m61_check_access(const void* ptr, size_t len, const char* file, long line);
+
+/// m61_usable_size(ptr, file, line)
+///    Return the size of the active block at `ptr`, as requested.
+size_t m61_usable_size(void* ptr, const char* file, long line);
+
 /// m61_get_statistics(stats)
 ///    Store the current memory statistics in `*stats`.
 void m61_get_statistics(m61_statistics* stats);
 
+/// m61_set_report_file(f)
+///    Print reports to `f` instead of stdout; nullptr restores stdout.
+void m61_set_report_file(FILE* f);
+
 /// m61_print_statistics()
 ///    Print the current memory statistics.
 void m61_print_statistics();
 
+/// m61_print_fragmentation_report()
+///    Print peak, reserved, free and metadata bytes, and internal and
+///    external fragmentation, overall and by size class.
+void m61_print_fragmentation_report();
+
+/// m61_print_latency_report()
+///    Print latency histograms for m61 operations (timed only when
+///    M61_LATENCY_SAMPLE is set) and allocation counts by size class.
+void m61_print_latency_report();
+
 /// m61_print_leak_report()
 ///    Print a report of all currently-active allocated blocks of dynamic
-///    memory.
+///    memory. Set M61_LEAK_REPORT=grouped (or json) in the environment to
+///    print per-call-site totals (as JSON lines) instead. With
+///    M61_STACK_DEPTH=N set, each leak also shows up to N stack frames.
 void m61_print_leak_report();
 
 /// m61_print_heavy_hitter_report()
-///    Print a report of heavily-used allocation locations.
+///    Print a report of heavily-used allocation locations, and of
+///    heavily-used allocation stacks if M61_STACK_DEPTH is set.
 void m61_print_heavy_hitter_report();
 
+/// m61_heap_snapshot
+///    The live bytes and blocks allocated at each call site at one time.
+struct m61_heap_snapshot;
+
+/// m61_snapshot()
+///    Return a snapshot of the heap, which costs time proportional to the
+///    number of call sites rather than of blocks. Release it with
+///    m61_snapshot_free().
+m61_heap_snapshot* m61_snapshot();
+
+/// m61_snapshot_diff(a, b)
+///    Print how the heap changed from snapshot `a` to the later snapshot
+///    `b` (`a` may be nullptr for an empty heap): the total change, then
+///    the call sites whose live bytes grew the most. Set
+///    M61_SNAPSHOT_SIGNAL=N in the environment to print the change since
+///    the previous signal N to stderr whenever the process receives it.
+void m61_snapshot_diff(const m61_heap_snapshot* a, const m61_heap_snapshot* b);
+
+/// m61_snapshot_free(snap)
+///    Release a snapshot returned by m61_snapshot().
+void m61_snapshot_free(m61_heap_snapshot* snap);
+
 /// `m61.cc` should use these functions rather than malloc() and free().
 void* base_malloc(size_t sz);
 void base_free(void* ptr);
@@ -73,25 +161,43 @@ void base_allocator_disable(bool is_disabled);
 #define free(ptr)           m61_free((ptr), __FILE__, __LINE__)
 #define calloc(nmemb, sz)   m61_calloc((nmemb), (sz), __FILE__, __LINE__)
 #define realloc(ptr, sz)   m61_realloc((ptr), (sz), __FILE__, __LINE__)
+#define m61_check_access(ptr, len) m61_check_access((ptr), (len), __FILE__, __LINE__)
+#define m61_usable_size(ptr) m61_usable_size((ptr), __FILE__, __LINE__)
+#define m61_aligned_alloc(align, sz) m61_aligned_alloc((align), (sz), __FILE__, __LINE__)
+#define m61_memalign(align, sz) m61_memalign((align), (sz), __FILE__, __LINE__)
 #endif
 
 
 /// This magic class lets standard C++ containers use your debugging allocator,
-/// instead of the system allocator.
+/// instead of the system allocator. Give an instance a name, as in
+/// `m61_allocator<int>("word_counts")`, to attribute its container's
+/// allocations to `word_counts:0` rather than `?:0` in reports; the name
+/// must outlive the allocator (a string literal is best).
 template <typename T>
 class m61_allocator {
 public:
     using value_type = T;
     m61_allocator() noexcept = default;
+    explicit m61_allocator(const char* name, long name_line = 0) noexcept
+        : file(name), line(name_line) {
+    }
     m61_allocator(const m61_allocator<T>&) noexcept = default;
-    template <typename U> m61_allocator(m61_allocator<U>&) noexcept {}
+    template <typename U> m61_allocator(const m61_allocator<U>& x) noexcept
+        : file(x.file), line(x.line) {
+    }
 
     T* allocate(size_t n) {
-        return reinterpret_cast<T*>(m61_malloc(n * sizeof(T), "?", 0));
+        if (alignof(T) > alignof(std::max_align_t)) {
+            return reinterpret_cast<T*>((m61_aligned_alloc)(alignof(T), n * sizeof(T), file, line));
+        }
+        return reinterpret_cast<T*>(m61_malloc(n * sizeof(T), file, line));
     }
     void deallocate(T* ptr, size_t) {
-        m61_free(ptr, "?", 0);
+        m61_free(ptr, file, line);
     }
+
+    const char* file = "?";
+    long line = 0;
 };
 template <typename T, typename U>
 inline constexpr bool operator==(const m61_allocator<T>&, const m61_allocator<U>&) {
@@ -102,4 +208,75 @@ inline constexpr bool operator!=(const m61_allocator<T>&, const m61_allocator<U>
     return false;
 }
 
+
+/// m61_arena
+///    A monotonic arena: allocate() bumps a pointer through chunks
+///    obtained from m61_malloc, and release() (or the destructor) frees
+///    every chunk at once; memory is never returned individually. Chunks
+///    are allocated at the arena's name, so reports attribute its memory
+///    to the data structure that owns it. Not thread-safe.
+class m61_arena {
+public:
+    explicit m61_arena(const char* tag = "?", size_t chunk = 64 << 10) noexcept;
+    ~m61_arena();
+    m61_arena(const m61_arena&) = delete;
+    m61_arena& operator=(const m61_arena&) = delete;
+
+    /// allocate(sz, align)
+    ///    Return `sz` bytes aligned to `align` (a power of 2), or nullptr
+    ///    if out of memory.
+    void* allocate(size_t sz, size_t align);
+    /// release()
+    ///    Free everything allocated from the arena.
+    void release();
+
+    const char* name;
+    size_t chunk_size;
+
+private:
+    void* chunks = nullptr; // chunks, linked through their first word
+    char* next = nullptr; // next free byte in the newest chunk
+    char* end = nullptr; // end of the newest chunk
+};
+
+/// m61_arena_allocator
+///    Lets standard C++ containers allocate from an m61_arena, as in
+///    `std::vector<int, m61_arena_allocator<int>> v(arena)`. Freeing does
+///    nothing; the memory goes back when the arena is released. Throws
+///    std::bad_alloc if the arena is out of memory.
+template <typename T>
+class m61_arena_allocator {
+public:
+    using value_type = T;
+    m61_arena_allocator(m61_arena& a) noexcept
+        : arena(&a) {
+    }
+    template <typename U> m61_arena_allocator(const m61_arena_allocator<U>& x) noexcept
+        : arena(x.arena) {
+    }
+
+    T* allocate(size_t n) {
+        void* ptr = nullptr;
+        if (n <= SIZE_MAX / sizeof(T)) {
+            ptr = arena->allocate(n * sizeof(T), alignof(T));
+        }
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return reinterpret_cast<T*>(ptr);
+    }
+    void deallocate(T*, size_t) {
+    }
+
+    m61_arena* arena;
+};
+template <typename T, typename U>
+inline bool operator==(const m61_arena_allocator<T>& a, const m61_arena_allocator<U>& b) {
+    return a.arena == b.arena;
+}
+template <typename T, typename U>
+inline bool operator!=(const m61_arena_allocator<T>& a, const m61_arena_allocator<U>& b) {
+    return a.arena != b.arena;
+}
+
 #endif
@@ -0,0 +1,204 @@
+#include "m61.hh"
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <fstream>
+// m61bench: measure m61 allocation throughput for several size mixes.
+//
+// Usage: ./m61bench [-t THREADS] [COUNT [MIX...]]
+//    Runs COUNT (default 1000000) malloc/free pairs for each MIX (default
+//    all of `tiny`, `small`, `large` and `huge`) and prints allocations per
+//    second, the mean time per pair, and the resident set size left once
+//    every block is freed. `huge` runs COUNT/256 pairs. Every block has one
+//    byte per page written, as a real user would. With `-t THREADS`, each
+//    mix is also run with 2, 4, ... up to THREADS threads, each doing COUNT
+//    pairs, and the total rate is printed.
+//
+// Usage: ./m61bench -s [-t THREADS] [COUNT]
+//    Measures false sharing instead: THREADS (default 1) threads each
+//    update a hot block COUNT times, while as many threads free and
+//    reallocate the block next to it, and the total update rate is
+//    printed with the number of hot blocks not on a cache line. Compare
+//    with M61_CACHE_ALIGN=1 in the environment.
+
+struct size_mix {
+    const char* name;
+    size_t min_size;
+    size_t max_size;
+    unsigned nptrs;         // live blocks kept
+    unsigned divisor;       // pairs run are COUNT / divisor
+};
+
+// The first three mixes follow the call sites in hhtest-*alloc.cc; `huge`
+// models multi-page buffers and keeps fewer of them live.
+static const size_mix mixes[] = {
+    {"tiny", 1, 64, 1024, 1},
+    {"small", 65, 2048, 1024, 1},
+    {"large", 2049, 24000, 1024, 1},
+    {"huge", 1 << 20, 4 << 20, 16, 256}
+};
+
+static double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long rss_kib() {
+    unsigned long size = 0, resident = 0;
+    std::ifstream("/proc/self/statm") >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void run_worker(const size_mix& mix, unsigned long count, unsigned seed) {
+    // Precompute sizes and slots so the timed loop measures the allocator.
+    std::vector<size_t> sizes(count);
+    std::vector<unsigned> slots(count);
+    for (unsigned long i = 0; i != count; ++i) {
+        sizes[i] = mix.min_size + rand_r(&seed) % (mix.max_size - mix.min_size + 1);
+        slots[i] = rand_r(&seed);
+    }
+
+    // Keep a pool of live blocks so frees happen in a shuffled order.
+    const unsigned nptrs = mix.nptrs;
+    std::vector<void*> ptrs(nptrs, nullptr);
+
+    for (unsigned long i = 0; i != count; ++i) {
+        char* ptr = (char*) malloc(sizes[i]);
+        for (size_t off = 0; off < sizes[i]; off += 4096) {
+            ptr[off] = 1;
+        }
+        unsigned slot = slots[i] % nptrs;
+        free(ptrs[slot]);
+        ptrs[slot] = ptr;
+    }
+    for (unsigned i = 0; i != nptrs; ++i) {
+        free(ptrs[i]);
+    }
+}
+
+static void run_mix(const size_mix& mix, unsigned long count, unsigned nthreads) {
+    count /= mix.divisor;
+    std::vector<std::thread> threads;
+    double start = timestamp();
+    for (unsigned t = 1; t < nthreads; ++t) {
+        threads.emplace_back(run_worker, std::cref(mix), count, t);
+    }
+    run_worker(mix, count, 0);
+    for (auto& th : threads) {
+        th.join();
+    }
+    double elapsed = timestamp() - start;
+
+    printf("%-6s %2u thread%s %12.0f allocs/sec %9.1f ns/pair %8lu KiB rss\n",
+           mix.name, nthreads, nthreads == 1 ? " " : "s",
+           count * nthreads / elapsed, elapsed * 1e9 / count, rss_kib());
+}
+
+// Hot blocks are 56 bytes, so with m61's 48-byte headers most end on the
+// cache line that holds the header of the block after them.
+static const size_t hot_size = 56;
+
+static void run_updater(volatile unsigned long* hot, unsigned long count) {
+    for (unsigned long i = 0; i != count; ++i) {
+        for (size_t w = 0; w != hot_size / sizeof(long); ++w) {
+            hot[w] = hot[w] + 1;
+        }
+    }
+}
+
+static void run_churner(void* ptr, const std::atomic<bool>* done) {
+    // a freed block is reused at once, so this keeps writing its header
+    while (!done->load(std::memory_order_relaxed)) {
+        free(ptr);
+        ptr = malloc(hot_size);
+    }
+    free(ptr);
+}
+
+static void run_sharing(unsigned long count, unsigned nthreads) {
+    // allocated back to back, so each hot block is followed by its
+    // churned neighbor
+    std::vector<void*> ptrs(2 * nthreads);
+    unsigned unaligned = 0;
+    for (unsigned t = 0; t != nthreads; ++t) {
+        ptrs[2 * t] = malloc(hot_size);
+        ptrs[2 * t + 1] = malloc(hot_size);
+        memset(ptrs[2 * t], 0, hot_size);
+        unaligned += (uintptr_t) ptrs[2 * t] % 64 != 0;
+    }
+
+    std::atomic<bool> done(false);
+    std::vector<std::thread> churners, updaters;
+    for (unsigned t = 0; t != nthreads; ++t) {
+        churners.emplace_back(run_churner, ptrs[2 * t + 1], &done);
+    }
+    double start = timestamp();
+    for (unsigned t = 0; t != nthreads; ++t) {
+        updaters.emplace_back(run_updater, (volatile unsigned long*) ptrs[2 * t], count);
+    }
+    for (auto& th : updaters) {
+        th.join();
+    }
+    double elapsed = timestamp() - start;
+    done = true;
+    for (auto& th : churners) {
+        th.join();
+    }
+    for (unsigned t = 0; t != nthreads; ++t) {
+        free(ptrs[2 * t]);
+    }
+
+    printf("sharing %2u thread%s %12.0f updates/sec %9.1f ns/update %4u/%u hot blocks unaligned\n",
+           nthreads, nthreads == 1 ? " " : "s",
+           count * nthreads / elapsed, elapsed * 1e9 / count, unaligned, nthreads);
+}
+
+int main(int argc, char** argv) {
+#if !M61_DISABLE
+    // use the system allocator, not the base allocator, as hhtest does
+    base_allocator_disable(1);
+#endif
+
+    unsigned max_threads = 1;
+    bool sharing = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "st:")) != -1) {
+        if (opt == 't') {
+            max_threads = strtoul(optarg, nullptr, 0);
+        } else if (opt == 's') {
+            sharing = true;
+        } else {
+            fprintf(stderr, "Usage: ./m61bench [-t THREADS] [COUNT [MIX...]]\n"
+                    "       ./m61bench -s [-t THREADS] [COUNT]\n");
+            exit(1);
+        }
+    }
+
+    unsigned long count = 1000000;
+    if (optind < argc) {
+        count = strtoul(argv[optind], nullptr, 0);
+    }
+
+    if (sharing) {
+        for (unsigned n = 1; n <= max_threads; n *= 2) {
+            run_sharing(count, n);
+        }
+        return 0;
+    }
+
+    for (auto& mix : mixes) {
+        bool selected = optind + 1 >= argc;
+        for (int i = optind + 1; i < argc; ++i) {
+            selected = selected || strcmp(argv[i], mix.name) == 0;
+        }
+        for (unsigned n = 1; selected && n <= max_threads; n *= 2) {
+            run_mix(mix, count, n);
+        }
+    }
+}
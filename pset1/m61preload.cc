@@ -0,0 +1,474 @@
+#define M61_DISABLE 1
+#include "m61.hh"
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <new>
+#include <algorithm>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// m61preload: the C and C++ allocation functions, replaced by m61, for
+// profiling unmodified binaries. Built into libm61.so with the rest of m61
+// (`make libm61.so`) and loaded with
+//
+//    LD_PRELOAD=./libm61.so M61_REPORT=leak,heavy ./program
+//
+// M61_REPORT names reports to print at exit, separated by commas:
+// `statistics`, `fragmentation`, `leak`, `heavy` and `latency`. They go to
+// a copy of stderr taken at startup, so they survive the program closing
+// its standard streams, or, with M61_REPORT_FILE=PATH, to PATH.PID. The
+// reports are printed from a destructor that runs after the program's
+// atexit handlers, and M61_REPORT is removed from the environment so
+// programs the process runs print no reports of their own. The other
+// M61_* settings work as usual. Allocations are attributed to
+// the function that called malloc (or operator new): the call site is
+// printed as SYMBOL:OFFSET, with SYMBOL mangled (pipe through c++filt),
+// or as OBJECT:OFFSET when the caller has no dynamic symbol.
+//
+// Everything but these functions is hidden, so a program linked with
+// m61.o keeps its own m61. Memory m61 allocates for its own bookkeeping,
+// and memory allocated before libm61.so is initialized or after its exit
+// report, come from the C library as "foreign" blocks, which m61 does not
+// track.
+
+#define M61_EXPORT extern "C" __attribute__((visibility("default")))
+
+extern "C" {
+void* __libc_malloc(size_t sz);
+void* __libc_calloc(size_t nmemb, size_t sz);
+void* __libc_memalign(size_t align, size_t sz);
+void __libc_free(void* ptr);
+}
+
+// A foreign block is preceded by a `foreign_prefix` whose `tag` sits
+// where an m61 block's header keeps its canary.
+struct foreign_prefix {
+    void* base;             // pointer from the C library
+    size_t size;            // bytes requested
+    uintptr_t unused;
+    uintptr_t tag;          // foreign_tag ^ address of the block
+};
+static_assert(sizeof(foreign_prefix) % alignof(std::max_align_t) == 0,
+              "foreign_prefix must preserve max_align_t alignment");
+
+static const uintptr_t foreign_tag = 0x6d3631666f726e21;
+
+// `depth` is nonzero while this thread is inside m61; allocations made
+// then are m61's own and must not re-enter it. `ready` is set once m61's
+// globals are constructed and cleared by the exit report.
+static thread_local int depth;
+static bool ready;
+
+// per-thread cache of call sites, keyed by return address
+struct preload_site {
+    uintptr_t pc;
+    const char* file;
+    long line;
+};
+static const unsigned preload_ncache = 64;
+static thread_local preload_site site_cache[preload_ncache];
+
+
+// foreign_alloc(align, sz, zero)
+//    Return a foreign block of `sz` bytes aligned to `align` (a power of
+//    2), zeroed if `zero` is true, or nullptr if out of memory.
+
+static void* foreign_alloc(size_t align, size_t sz, bool zero) {
+    size_t pad = std::max(align, sizeof(foreign_prefix));
+    if (sz > SIZE_MAX - pad) {
+        return nullptr;
+    }
+    char* base;
+    if (align <= alignof(std::max_align_t)) {
+        base = (char*) (zero ? __libc_calloc(1, pad + sz) : __libc_malloc(pad + sz));
+    } else {
+        base = (char*) __libc_memalign(align, pad + sz);
+        if (base && zero) {
+            memset(base, 0, pad + sz);
+        }
+    }
+    if (!base) {
+        return nullptr;
+    }
+    char* ptr = base + pad;
+    foreign_prefix* fp = (foreign_prefix*) ptr - 1;
+    fp->base = base;
+    fp->size = sz;
+    fp->tag = foreign_tag ^ (uintptr_t) ptr;
+    return ptr;
+}
+
+// foreign_of(ptr)
+//    Return the prefix of `ptr` if it is a foreign block, or nullptr.
+
+static foreign_prefix* foreign_of(void* ptr) {
+    if ((uintptr_t) ptr % alignof(std::max_align_t) != 0) {
+        return nullptr;
+    }
+    foreign_prefix* fp = (foreign_prefix*) ptr - 1;
+    return fp->tag == (foreign_tag ^ (uintptr_t) ptr) ? fp : nullptr;
+}
+
+// foreign_free(fp)
+//    Free the foreign block whose prefix is `fp`.
+
+static void foreign_free(foreign_prefix* fp) {
+    fp->tag = 0;
+    __libc_free(fp->base);
+}
+
+// caller_site(pc)
+//    Return the call site of the allocation function called from `pc`:
+//    its caller's dynamic symbol and offset, else its object and offset.
+//    Caller must be inside m61 (`depth` nonzero), since dladdr may
+//    allocate.
+
+static const preload_site& caller_site(void* pc) {
+    uintptr_t addr = (uintptr_t) pc;
+    preload_site& c = site_cache[(addr >> 2) % preload_ncache];
+    if (c.pc != addr) {
+        Dl_info info;
+        c = {addr, "?", 0};
+        if (dladdr(pc, &info) && info.dli_sname) {
+            c.file = info.dli_sname;
+            c.line = addr - (uintptr_t) info.dli_saddr;
+        } else if (info.dli_fname) {
+            c.file = info.dli_fname[0] ? info.dli_fname : "main";
+            c.line = addr - (uintptr_t) info.dli_fbase;
+        }
+    }
+    return c;
+}
+
+// preload_malloc(align, sz, zero, pc)
+//    Allocate `sz` bytes aligned to `align` for the caller at `pc`. This
+//    and the other preload_ helpers are inlined into the functions they
+//    implement, so m61 is always called from exactly one libm61.so frame
+//    (see stack_skip in m61.cc).
+
+static inline __attribute__((always_inline))
+void* preload_malloc(size_t align, size_t sz, bool zero, void* pc) {
+    void* ptr;
+    if (depth || !ready) {
+        ptr = foreign_alloc(align, sz, zero);
+    } else {
+        ++depth;
+        const preload_site& site = caller_site(pc);
+        if (zero) {
+            ptr = m61_calloc(1, sz, site.file, site.line);
+        } else if (align > alignof(std::max_align_t)) {
+            ptr = m61_aligned_alloc(align, sz, site.file, site.line);
+        } else {
+            ptr = m61_malloc(sz, site.file, site.line);
+        }
+        --depth;
+    }
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+// preload_free(ptr, pc)
+//    Free `ptr` for the caller at `pc`. m61 blocks freed after the exit
+//    report are left alone.
+
+static inline __attribute__((always_inline))
+void preload_free(void* ptr, void* pc) {
+    if (!ptr) {
+        return;
+    } else if (foreign_prefix* fp = foreign_of(ptr)) {
+        foreign_free(fp);
+    } else if (ready) {
+        ++depth;
+        const preload_site& site = caller_site(pc);
+        m61_free(ptr, site.file, site.line);
+        --depth;
+    }
+}
+
+// preload_memalign(align, sz, pc)
+//    Allocate `sz` bytes aligned to `align`, which must be a power of 2.
+
+static inline __attribute__((always_inline))
+void* preload_memalign(size_t align, size_t sz, void* pc) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return preload_malloc(align, sz, false, pc);
+}
+
+// preload_new(align, sz, pc)
+//    Allocate for operator new, calling the new handler until it succeeds.
+
+static inline __attribute__((always_inline))
+void* preload_new(size_t align, size_t sz, void* pc) {
+    while (true) {
+        if (void* ptr = preload_malloc(align, sz, false, pc)) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+
+M61_EXPORT void* malloc(size_t sz) {
+    return preload_malloc(1, sz, false, __builtin_return_address(0));
+}
+
+M61_EXPORT void free(void* ptr) {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT void* calloc(size_t nmemb, size_t sz) {
+    if (nmemb != 0 && sz > SIZE_MAX / nmemb) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return preload_malloc(1, nmemb * sz, true, __builtin_return_address(0));
+}
+
+M61_EXPORT void* realloc(void* ptr, size_t sz) {
+    void* pc = __builtin_return_address(0);
+    foreign_prefix* fp = ptr ? foreign_of(ptr) : nullptr;
+    if (ptr && !fp && ready) {
+        ++depth;
+        const preload_site& site = caller_site(pc);
+        void* new_ptr = m61_realloc(ptr, sz, site.file, site.line);
+        --depth;
+        if (!new_ptr && sz) {
+            errno = ENOMEM;
+        }
+        return new_ptr;
+    } else if (ptr && !fp) {
+        // an m61 block after the exit report, which stays put
+        void* new_ptr = sz ? foreign_alloc(1, sz, false) : nullptr;
+        if (new_ptr) {
+            memcpy(new_ptr, ptr, std::min(m61_usable_size(ptr, "?", 0), sz));
+        }
+        return new_ptr;
+    } else if (fp && sz == 0) {
+        foreign_free(fp);
+        return nullptr;
+    }
+
+    // a new block, or a foreign block that becomes an m61 block if m61
+    // can take it
+    void* new_ptr = preload_malloc(1, sz, false, pc);
+    if (fp && new_ptr) {
+        memcpy(new_ptr, ptr, std::min(fp->size, sz));
+        foreign_free(fp);
+    }
+    return new_ptr;
+}
+
+M61_EXPORT int posix_memalign(void** memptr, size_t align, size_t sz) {
+    if (align % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    int saved_errno = errno;
+    void* ptr = preload_memalign(align, sz, __builtin_return_address(0));
+    int error = ptr ? 0 : errno;
+    errno = saved_errno;
+    if (ptr) {
+        *memptr = ptr;
+    }
+    return error;
+}
+
+M61_EXPORT void* aligned_alloc(size_t align, size_t sz) {
+    return preload_memalign(align, sz, __builtin_return_address(0));
+}
+
+M61_EXPORT void* memalign(size_t align, size_t sz) {
+    return preload_memalign(align, sz, __builtin_return_address(0));
+}
+
+M61_EXPORT void* valloc(size_t sz) {
+    return preload_memalign(sysconf(_SC_PAGESIZE), sz, __builtin_return_address(0));
+}
+
+M61_EXPORT void* pvalloc(size_t sz) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (sz > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return preload_memalign(page, (sz + page - 1) & -page, __builtin_return_address(0));
+}
+
+M61_EXPORT size_t malloc_usable_size(void* ptr) {
+    if (!ptr) {
+        return 0;
+    } else if (foreign_prefix* fp = foreign_of(ptr)) {
+        return fp->size;
+    } else if (!ready) {
+        return 0;
+    }
+    ++depth;
+    const preload_site& site = caller_site(__builtin_return_address(0));
+    size_t sz = m61_usable_size(ptr, site.file, site.line);
+    --depth;
+    return sz;
+}
+
+
+#define M61_EXPORT_CXX __attribute__((visibility("default")))
+
+M61_EXPORT_CXX void* operator new(size_t sz) {
+    return preload_new(1, sz, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void* operator new[](size_t sz) {
+    return preload_new(1, sz, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void* operator new(size_t sz, std::align_val_t align) {
+    return preload_new((size_t) align, sz, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void* operator new[](size_t sz, std::align_val_t align) {
+    return preload_new((size_t) align, sz, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void* operator new(size_t sz, const std::nothrow_t&) noexcept {
+    return preload_malloc(1, sz, false, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void* operator new[](size_t sz, const std::nothrow_t&) noexcept {
+    return preload_malloc(1, sz, false, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void* operator new(size_t sz, std::align_val_t align,
+                                  const std::nothrow_t&) noexcept {
+    return preload_malloc((size_t) align, sz, false, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void* operator new[](size_t sz, std::align_val_t align,
+                                    const std::nothrow_t&) noexcept {
+    return preload_malloc((size_t) align, sz, false, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete(void* ptr) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete[](void* ptr) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete(void* ptr, size_t) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete[](void* ptr, size_t) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete(void* ptr, std::align_val_t) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete[](void* ptr, std::align_val_t) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+M61_EXPORT_CXX void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    preload_free(ptr, __builtin_return_address(0));
+}
+
+
+// reports named in M61_REPORT, and the stream they print to
+static char report_names[128];
+static FILE* report_file;
+
+// preload_report()
+//    Destructor: print the reports named in M61_REPORT, then stop using
+//    m61. Runs once, after the program's atexit handlers and static
+//    destructors.
+
+__attribute__((destructor)) static void preload_report() {
+    if (!ready) {
+        return;
+    }
+    ++depth;
+    for (const char* s = report_names; *s; ) {
+        size_t n = strcspn(s, ",");
+        if (n == 10 && memcmp(s, "statistics", n) == 0) {
+            m61_print_statistics();
+        } else if (n == 13 && memcmp(s, "fragmentation", n) == 0) {
+            m61_print_fragmentation_report();
+        } else if (n == 4 && memcmp(s, "leak", n) == 0) {
+            m61_print_leak_report();
+        } else if (n == 5 && memcmp(s, "heavy", n) == 0) {
+            m61_print_heavy_hitter_report();
+        } else if (n == 7 && memcmp(s, "latency", n) == 0) {
+            m61_print_latency_report();
+        }
+        s += n + (s[n] == ',');
+    }
+    if (report_file) {
+        fclose(report_file);
+        report_file = nullptr;
+        m61_set_report_file(nullptr);
+    }
+    ready = false;
+    --depth;
+}
+
+// preload_open_report()
+//    Take M61_REPORT out of the environment and open the stream the
+//    reports print to.
+
+static void preload_open_report() {
+    const char* reports = getenv("M61_REPORT");
+    if (!reports || !*reports) {
+        return;
+    }
+    snprintf(report_names, sizeof(report_names), "%s", reports);
+    unsetenv("M61_REPORT");
+
+    int fd;
+    if (const char* path = getenv("M61_REPORT_FILE")) {
+        char buf[4096];
+        snprintf(buf, sizeof(buf), "%s.%ld", path, (long) getpid());
+        fd = open(buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    } else {
+        fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+    }
+    if (fd >= 0 && !(report_file = fdopen(fd, "w"))) {
+        close(fd);
+    }
+    m61_set_report_file(report_file);
+}
+
+// preload_init()
+//    Constructor: start using m61. m61preload.o is linked last, so this
+//    runs after the other objects' static constructors.
+
+__attribute__((constructor)) static void preload_init() {
+    // large blocks go straight to the C library rather than waiting in
+    // the base allocator to catch use-after-free in the tests
+    base_allocator_disable(1);
+    preload_open_report();
+    ready = true;
+}
@@ -0,0 +1,165 @@
+#include "m61.hh"
+#include "m61trace.hh"
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <unistd.h>
+#include <fstream>
+// m61replay: replay an allocation trace recorded with M61_TRACE=FILE.
+//
+// Usage: ./m61replay [-s] TRACE
+//    Reads TRACE, orders its records by time, and replays them in one
+//    thread against m61 (or, with `-s`, the system allocator), writing
+//    one byte per page of every block as m61bench does. Replayed blocks
+//    are allocated at site `replay`:SITE, where SITE is the site id in
+//    the traced process. Prints the throughput, the peak bytes live, the
+//    peak growth in resident set size, and fragmentation: that growth
+//    over the peak bytes live.
+
+static bool use_system = false;
+
+static double timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long rss_kib() {
+    unsigned long size = 0, resident = 0;
+    std::ifstream("/proc/self/statm") >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void touch(void* ptr, size_t sz) {
+    for (size_t off = 0; off < sz; off += 4096) {
+        static_cast<char*>(ptr)[off] = 1;
+    }
+}
+
+static void* replay_malloc(size_t sz, uint32_t site) {
+    return use_system ? (malloc)(sz) : m61_malloc(sz, "replay", site);
+}
+
+static void replay_free(void* ptr, uint32_t site) {
+    use_system ? (free)(ptr) : m61_free(ptr, "replay", site);
+}
+
+static void* replay_realloc(void* ptr, size_t sz, uint32_t site) {
+    return use_system ? (realloc)(ptr, sz) : m61_realloc(ptr, sz, "replay", site);
+}
+
+static bool read_trace(const char* path, std::vector<m61_trace_record>& records) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    m61_trace_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || memcmp(header.magic, m61_trace_magic, sizeof(header.magic)) != 0
+        || header.version != m61_trace_version
+        || header.record_size != sizeof(m61_trace_record)) {
+        fprintf(stderr, "%s: not an m61 trace\n", path);
+        fclose(f);
+        return false;
+    }
+    m61_trace_record r;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        records.push_back(r);
+    }
+    fclose(f);
+    // threads write their records in batches
+    std::stable_sort(records.begin(), records.end(),
+                     [] (const m61_trace_record& a, const m61_trace_record& b) {
+                         return a.time < b.time;
+                     });
+    return true;
+}
+
+int main(int argc, char** argv) {
+    // use the system allocator, not the base allocator, as m61bench does
+    base_allocator_disable(1);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt == 's') {
+            use_system = true;
+        } else {
+            fprintf(stderr, "Usage: ./m61replay [-s] TRACE\n");
+            exit(1);
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "Usage: ./m61replay [-s] TRACE\n");
+        exit(1);
+    }
+
+    std::vector<m61_trace_record> records;
+    if (!read_trace(argv[optind], records)) {
+        exit(1);
+    }
+
+    // traced pointer -> replayed pointer and size
+    std::unordered_map<uint64_t, std::pair<void*, size_t>> live;
+    live.reserve(records.size());
+    size_t live_bytes = 0, peak_bytes = 0, sampled_bytes = 0, nskipped = 0;
+    unsigned long rss0 = rss_kib(), peak_rss = rss0;
+
+    double start = timestamp();
+    for (size_t i = 0; i != records.size(); ++i) {
+        const m61_trace_record& r = records[i];
+        if (r.op == m61_trace_malloc) {
+            void* ptr = replay_malloc(r.size, r.site);
+            if (ptr) {
+                touch(ptr, r.size);
+                live[r.ptr] = {ptr, r.size};
+                live_bytes += r.size;
+            }
+        } else if (r.op == m61_trace_free || r.op == m61_trace_realloc) {
+            auto it = live.find(r.op == m61_trace_free ? r.ptr : r.old_ptr);
+            if (it == live.end()) {
+                ++nskipped;
+                continue;
+            }
+            auto block = it->second;
+            live.erase(it);
+            live_bytes -= block.second;
+            if (r.op == m61_trace_free) {
+                replay_free(block.first, r.site);
+            } else if (void* ptr = replay_realloc(block.first, r.size, r.site)) {
+                touch(ptr, r.size);
+                live[r.ptr] = {ptr, r.size};
+                live_bytes += r.size;
+            }
+        }
+        // sample the resident set periodically and as live bytes peak
+        if (live_bytes > peak_bytes) {
+            peak_bytes = live_bytes;
+        }
+        if (i % 65536 == 0 || peak_bytes > sampled_bytes + sampled_bytes / 16) {
+            peak_rss = std::max(peak_rss, rss_kib());
+            sampled_bytes = peak_bytes;
+        }
+    }
+    double elapsed = timestamp() - start;
+    peak_rss = std::max(peak_rss, rss_kib());
+
+    printf("%-6s %10zu ops %12.0f ops/sec %9.1f ns/op\n",
+           use_system ? "system" : "m61", records.size(),
+           records.size() / elapsed, elapsed * 1e9 / records.size());
+    printf("%-6s %10zu KiB peak live %8lu KiB peak rss growth, fragmentation %.2f\n",
+           use_system ? "system" : "m61", peak_bytes / 1024, peak_rss - rss0,
+           peak_bytes ? (peak_rss - rss0) * 1024.0 / peak_bytes : 0.0);
+    if (nskipped) {
+        printf("%zu records skipped: their blocks were never allocated in the trace\n",
+               nskipped);
+    }
+
+    for (auto& it : live) {
+        replay_free(it.second.first, 0);
+    }
+}
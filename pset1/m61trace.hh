@@ -0,0 +1,43 @@
+#ifndef M61TRACE_HH
+#define M61TRACE_HH 1
+#include <cinttypes>
+
+/// Allocation traces
+///    With M61_TRACE=FILE in the environment, m61 writes every
+///    allocation, free and in-place realloc to FILE: an m61_trace_header,
+///    then m61_trace_records in host byte order. Each thread buffers its
+///    records and writes them in batches, so records are ordered by time
+///    only within a thread. A realloc that moves its block is recorded as
+///    the malloc and free it consists of. `m61replay` replays a trace.
+
+enum m61_trace_op : uint32_t {
+    m61_trace_malloc = 1,
+    m61_trace_free = 2,
+    m61_trace_realloc = 3
+};
+
+struct m61_trace_header {
+    char magic[8];          // m61_trace_magic
+    uint32_t version;       // m61_trace_version
+    uint32_t record_size;   // sizeof(m61_trace_record)
+};
+
+struct m61_trace_record {
+    uint64_t time;          // nanoseconds since the trace started
+    uint64_t ptr;           // block allocated, or freed by m61_trace_free
+    uint64_t old_ptr;       // block an m61_trace_realloc resized
+    uint64_t size;          // bytes requested; 0 for m61_trace_free
+    uint32_t site;          // call site id within the traced process
+    uint32_t op;            // an m61_trace_op
+};
+
+static const char m61_trace_magic[8] = {'M', '6', '1', 'T', 'R', 'A', 'C', 'E'};
+static const uint32_t m61_trace_version = 1;
+
+/// m61_trace_flush()
+///    Write the calling thread's buffered trace records to the trace file.
+///    Threads' buffers are also written when they fill, when the thread
+///    exits, and (for the thread calling exit()) at exit.
+void m61_trace_flush();
+
+#endif
@@ -0,0 +1,51 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <thread>
+// Multithreaded stress test: threads allocate, free their own blocks, and
+// hand blocks to the main thread to free (cross-thread frees).
+
+const int nthreads = 8;
+const int nallocs = 100000;
+const int nkept = 100;
+char* kept[nthreads][nkept];
+
+void worker(int t) {
+    char* ptrs[16] = {};
+    for (int i = 0; i != nallocs; ++i) {
+        char* p = (char*) malloc(1 + i % 100);
+        memset(p, t, 1 + i % 100);
+        int slot = i % 16;
+        free(ptrs[slot]);
+        ptrs[slot] = p;
+    }
+    for (int i = 0; i != 16; ++i) {
+        free(ptrs[i]);
+    }
+    for (int i = 0; i != nkept; ++i) {
+        kept[t][i] = (char*) malloc(3000);
+    }
+}
+
+int main() {
+    std::thread threads[nthreads];
+    for (int t = 0; t != nthreads; ++t) {
+        threads[t] = std::thread(worker, t);
+    }
+    for (int t = 0; t != nthreads; ++t) {
+        threads[t].join();
+    }
+    m61_print_statistics();
+    for (int t = 0; t != nthreads; ++t) {
+        for (int i = 0; i != nkept; ++i) {
+            free(kept[t][i]);
+        }
+    }
+    m61_print_statistics();
+}
+
+//! alloc count: active        800   total     800800   fail          0
+//! alloc size:  active    2400000   total   42800000   fail          0
+//! alloc count: active          0   total     800800   fail          0
+//! alloc size:  active          0   total   42800000   fail          0
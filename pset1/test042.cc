@@ -0,0 +1,21 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Advanced error message for an interior free in a heap with many blocks.
+
+const int nptrs = 200000;
+char* ptrs[nptrs];
+
+int main() {
+    for (int i = 0; i != nptrs; ++i) {
+        ptrs[i] = (char*) malloc(1 + i % 3000);
+    }
+    free(ptrs[123456] + 77);
+    m61_print_statistics();
+}
+
+//!!TIME
+//! MEMORY BUG: test???.cc:14: invalid free of pointer ???, not allocated
+//!   test???.cc:12: ??? is 77 bytes inside a 457 byte region allocated here
+//! ???
@@ -0,0 +1,36 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Check that realloc shrinks and grows within a block's slack in place,
+// preserves contents when it moves, and keeps statistics consistent.
+
+int main() {
+    char* p = (char*) malloc(10);
+    memcpy(p, "abcdefghi", 10);
+    char* q = (char*) realloc(p, 12);       // fits the same size class
+    assert(q == p);
+    q = (char*) realloc(q, 4);              // shrink
+    assert(q == p);
+    q[3] = 0;
+    assert(strcmp(q, "abc") == 0);
+
+    char* r = (char*) realloc(q, 5000);     // must move
+    assert(r != q);
+    assert(memcmp(r, "abc", 4) == 0);
+    memset(r, 'x', 5000);
+    char* s = (char*) realloc(r, 4000);     // large shrink stays put
+    assert(s == r);
+    s = (char*) realloc(s, 4900);
+    assert(s == r && s[3999] == 'x');
+
+    m61_statistics stat;
+    m61_get_statistics(&stat);
+    printf("realloc %llu, in place %llu\n", stat.nrealloc, stat.nrealloc_inplace);
+    m61_print_statistics();
+    free(s);
+}
+
+//! realloc 5, in place 4
+//! alloc count: active          1   total          6   fail          0
+//! alloc size:  active       4900   total      13926   fail          0
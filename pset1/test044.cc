@@ -0,0 +1,38 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+// Large blocks are mapped to end just before a guard page, grow without
+// losing their contents by remapping, and still diagnose double frees
+// once unmapped.
+
+int main() {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    char* ptr = (char*) malloc(2000000);
+    uintptr_t end = (uintptr_t) ptr + 2000000 + 1;
+    assert(((end + page - 1) & -page) - end < 16);
+    memset(ptr, 'a', 2000000);
+
+    // growing remaps the pages, keeping the data's offset in its page,
+    // rather than copying to a new block that ends at its guard page
+    uintptr_t offset = (uintptr_t) ptr & (page - 1);
+    ptr = (char*) realloc(ptr, 5000000);
+    assert(((uintptr_t) ptr & (page - 1)) == offset);
+    assert(ptr[0] == 'a' && ptr[1999999] == 'a');
+    memset(ptr, 'b', 5000000);
+    m61_print_statistics();
+    fflush(stdout);
+
+    free(ptr);
+    fprintf(stderr, "Will free %p\n", ptr);
+    free(ptr);
+    m61_print_statistics();
+}
+
+//! alloc count: active          1   total          2   fail          0
+//! alloc size:  active    5000000   total    7000000   fail          0
+//! Will free ??{0x\w+}=ptr??
+//! MEMORY BUG???: invalid free of pointer ??ptr??, double free
+//! ???
@@ -0,0 +1,30 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// Grouped and JSON leak reports total leaks by call site.
+
+int main() {
+    for (int i = 0; i != 10; ++i) {
+        (void) malloc(100);
+    }
+    for (int i = 0; i != 3; ++i) {
+        (void) malloc(1000);
+    }
+    void* ptr = malloc(5);
+    free(ptr);
+
+    printf("grouped\n");
+    setenv("M61_LEAK_REPORT", "grouped", 1);
+    m61_print_leak_report();
+    printf("json\n");
+    setenv("M61_LEAK_REPORT", "json", 1);
+    m61_print_leak_report();
+}
+
+//! grouped
+//! LEAK CHECK: test???.cc:12: 3 objects with total size 3000
+//! LEAK CHECK: test???.cc:9: 10 objects with total size 1000
+//! json
+//! {"file":"test???.cc","line":12,"count":3,"size":3000}
+//! {"file":"test???.cc","line":9,"count":10,"size":1000}
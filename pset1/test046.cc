@@ -0,0 +1,26 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// Latency report: timed operations and allocations by size class.
+
+int main() {
+    // time every operation; read when the allocator first initializes
+    setenv("M61_LATENCY_SAMPLE", "1", 1);
+    for (int i = 0; i != 1000; ++i) {
+        free(malloc(10));
+    }
+    for (int i = 0; i != 10; ++i) {
+        free(malloc(5000));
+    }
+    m61_print_latency_report();
+}
+
+//! LATENCY malloc: 1010 timed, mean ??? ns, p50 < ??? ns, p99 < ??? ns
+//! ???
+//! LATENCY free: 1010 timed, mean ??? ns, p50 < ??? ns, p99 < ??? ns
+//! ???
+//! LATENCY backend: ??? timed, mean ??? ns, p50 < ??? ns, p99 < ??? ns
+//! ???
+//! SIZE CLASS 16: 1000 allocations
+//! SIZE CLASS large: 10 allocations
@@ -0,0 +1,20 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// With redzones on, m61_check_access finds an overflow at once.
+
+int main() {
+    // read when the allocator first initializes
+    setenv("M61_REDZONE", "16", 1);
+    char* ptr = (char*) malloc(10);
+    m61_check_access(ptr, 10);
+    fprintf(stderr, "Will check %p\n", ptr + 8);
+    m61_check_access(ptr + 8, 4);
+    printf("should not get here\n");
+}
+
+//! Will check ??{0x\w+}=ptr??
+//! MEMORY BUG: test???.cc:13: invalid access to ??{0x\w+}?? (4 bytes), redzone
+//!   test???.cc:10: ??? is 0 bytes past the end of a 10 byte region allocated here
+//! ???
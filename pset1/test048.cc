@@ -0,0 +1,26 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+// A redzone sweep catches an overflow before the block is freed.
+
+int main() {
+    // read when the allocator first initializes
+    setenv("M61_REDZONE", "16", 1);
+    setenv("M61_SWEEP", "4", 1);
+    char* ptrs[3];
+    for (int i = 0; i != 3; ++i) {
+        ptrs[i] = (char*) malloc(20);
+    }
+    memset(ptrs[1], 'x', 24);    // 4 bytes too many
+    fprintf(stderr, "Overflowed %p\n", ptrs[1]);
+    char* more = (char*) malloc(20);
+    free(more);
+    printf("should not get here\n");
+}
+
+//! Overflowed ??{0x\w+}=ptr??
+//! MEMORY BUG: test???.cc:18: redzone sweep detected wild write around pointer ??ptr??
+//!   test???.cc:14: ??ptr?? was allocated here
+//! ???
@@ -0,0 +1,24 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// A write to a quarantined block is reported when the block leaves
+// quarantine, with where it was allocated and freed.
+
+int main() {
+    // read when the allocator first initializes
+    setenv("M61_QUARANTINE", "4096", 1);
+    char* ptr = (char*) malloc(100);
+    free(ptr);
+    fprintf(stderr, "Writing to freed %p\n", ptr);
+    ptr[42] = 'x';
+    for (int i = 0; i != 100; ++i) {
+        free(malloc(100));
+    }
+    printf("should not get here\n");
+}
+
+//! Writing to freed ??{0x\w+}=ptr??
+//! MEMORY BUG: test???.cc:12: pointer ??ptr?? was written after this free, 42 bytes into a 100 byte region
+//!   test???.cc:11: ??ptr?? was allocated here
+//! ???
@@ -0,0 +1,25 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// A double free reports where the block was allocated and first freed.
+
+int main() {
+    char* ptr = (char*) malloc(2001);
+    for (int i = 0; i != 100; ++i) {
+        free(malloc(i));
+    }
+    free(ptr);
+    for (int i = 0; i != 100; ++i) {
+        free(malloc(i));
+    }
+    fprintf(stderr, "Will free %p\n", ptr);
+    free(ptr);
+    m61_print_statistics();
+}
+
+//! Will free ??{0x\w+}=ptr??
+//! MEMORY BUG: test???.cc:17: invalid free of pointer ??ptr??, double free
+//!   test???.cc:12: ??ptr?? was freed here
+//!   test???.cc:8: ??ptr?? (2001 bytes) was allocated here
+//! ???
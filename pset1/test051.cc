@@ -0,0 +1,25 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// Allocations from many distinct call sites are each counted separately.
+
+int main() {
+    const char* file = "site.cc";
+    for (long line = 1; line <= 20000; ++line) {
+        void* ptr = m61_malloc(10, file, line);
+        m61_free(ptr, __FILE__, __LINE__);
+    }
+    for (int i = 0; i != 100; ++i) {
+        void* ptr = m61_malloc(1000, file, 12345);
+        m61_free(ptr, __FILE__, __LINE__);
+    }
+    (void) m61_malloc(7, file, 19999);
+    (void) m61_malloc(8, file, 19999);
+    m61_print_heavy_hitter_report();
+    setenv("M61_LEAK_REPORT", "grouped", 1);
+    m61_print_leak_report();
+}
+
+//! HEAVY HITTER: site.cc:12345: 100010 bytes (~33.3%)
+//! LEAK CHECK: site.cc:19999: 2 objects with total size 15
@@ -0,0 +1,57 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// With M61_STACK_DEPTH, reports split a call site by the stacks through it.
+
+extern "C" __attribute__((noinline)) void* leaf(size_t sz) {
+    void* ptr = malloc(sz);
+    asm volatile("" : : "r" (ptr) : "memory");   // not a tail call
+    return ptr;
+}
+
+extern "C" __attribute__((noinline)) void* mid(size_t sz) {
+    void* ptr = leaf(sz);
+    asm volatile("" : : "r" (ptr) : "memory");
+    return ptr;
+}
+
+extern "C" __attribute__((noinline)) void* other(size_t sz) {
+    void* ptr = leaf(sz);
+    asm volatile("" : : "r" (ptr) : "memory");
+    return ptr;
+}
+
+int main() {
+    setenv("M61_STACK_DEPTH", "2", 1);
+    for (int i = 0; i != 10; ++i) {
+        (void) mid(100);
+    }
+    for (int i = 0; i != 3; ++i) {
+        (void) other(1000);
+    }
+    m61_print_heavy_hitter_report();
+    setenv("M61_LEAK_REPORT", "grouped", 1);
+    m61_print_leak_report();
+}
+
+//! HEAVY HITTER: test???.cc:8: 4000 bytes (~100.0%)
+//! FREQUENTLY ALLOCATED: test???.cc:8: 13 count (~100.0%)
+//! HEAVY HITTER STACK: test???.cc:8: 3000 bytes (~75.0%)
+//!    #0 0x??? leaf+0x???
+//!    #1 0x??? other+0x???
+//! HEAVY HITTER STACK: test???.cc:8: 1000 bytes (~25.0%)
+//!    #0 0x??? leaf+0x???
+//!    #1 0x??? mid+0x???
+//! FREQUENTLY ALLOCATED STACK: test???.cc:8: 10 count (~76.9%)
+//!    #0 0x??? leaf+0x???
+//!    #1 0x??? mid+0x???
+//! FREQUENTLY ALLOCATED STACK: test???.cc:8: 3 count (~23.1%)
+//!    #0 0x??? leaf+0x???
+//!    #1 0x??? other+0x???
+//! LEAK CHECK: test???.cc:8: 3 objects with total size 3000
+//!    #0 0x??? leaf+0x???
+//!    #1 0x??? other+0x???
+//! LEAK CHECK: test???.cc:8: 10 objects with total size 1000
+//!    #0 0x??? leaf+0x???
+//!    #1 0x??? mid+0x???
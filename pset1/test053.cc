@@ -0,0 +1,39 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <vector>
+#include <unordered_map>
+// Named allocators and arenas attribute container memory to their names.
+
+using index_allocator = m61_arena_allocator<std::pair<const int, int>>;
+
+int main() {
+    std::vector<int, m61_allocator<int>> names(m61_allocator<int>("names"));
+    names.reserve(10000);
+
+    m61_arena arena("index");
+    {
+        std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, index_allocator>
+            index(16, std::hash<int>(), std::equal_to<int>(), index_allocator(arena));
+        for (int i = 0; i != 1000; ++i) {
+            index[i] = i;
+        }
+        assert(index.size() == 1000 && index[999] == 999);
+    }
+    m61_print_heavy_hitter_report();
+
+    // every node and bucket array lives in one 64 KiB chunk
+    m61_statistics stat;
+    m61_get_statistics(&stat);
+    assert(stat.nactive == 2);
+    arena.release();
+    m61_get_statistics(&stat);
+    assert(stat.nactive == 1);
+    m61_print_leak_report();
+}
+
+//! HEAVY HITTER: index:0: 65552 bytes (~62.1%)
+//! HEAVY HITTER: names:0: 40000 bytes (~37.9%)
+//! FREQUENTLY ALLOCATED: names:0: 1 count (~50.0%)
+//! FREQUENTLY ALLOCATED: index:0: 1 count (~50.0%)
+//! LEAK CHECK: names:0: allocated object ??{0x\w+}?? with size 40000
@@ -0,0 +1,44 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <thread>
+// Heap snapshots show which call sites grew in between.
+
+void* ptrs[100];
+
+int main() {
+    for (int i = 0; i != 10; ++i) {
+        ptrs[i] = malloc(100);
+    }
+    m61_heap_snapshot* a = m61_snapshot();
+
+    for (int i = 10; i != 40; ++i) {
+        ptrs[i] = malloc(1000);
+    }
+    for (int i = 0; i != 5; ++i) {
+        free(ptrs[i]);
+    }
+    // blocks freed by another thread are subtracted too
+    std::thread t([] () {
+        for (int i = 10; i != 20; ++i) {
+            free(ptrs[i]);
+        }
+    });
+    t.join();
+    for (int i = 40; i != 44; ++i) {
+        ptrs[i] = malloc(30);
+    }
+    m61_heap_snapshot* b = m61_snapshot();
+
+    m61_snapshot_diff(a, b);
+    m61_snapshot_diff(nullptr, a);
+    m61_snapshot_free(a);
+    m61_snapshot_free(b);
+}
+
+//! SNAPSHOT DIFF: +19620 bytes, +19 objects
+//! SNAPSHOT DIFF: test???.cc:17: +20000 bytes, +20 objects, 20000 live bytes
+//! SNAPSHOT DIFF: test???.cc:30: +120 bytes, +4 objects, 120 live bytes
+//! SNAPSHOT DIFF: +1000 bytes, +10 objects
+//! SNAPSHOT DIFF: test???.cc:12: +1000 bytes, +10 objects, 1000 live bytes
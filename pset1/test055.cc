@@ -0,0 +1,48 @@
+#include "m61.hh"
+#include "m61trace.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+// M61_TRACE records each allocation, free and in-place realloc.
+
+int main() {
+    char path[100];
+    snprintf(path, sizeof(path), "/tmp/m61trace.%d", getpid());
+    // read when the allocator first initializes
+    setenv("M61_TRACE", path, 1);
+    void* ptr = malloc(100);
+    void* ptr2 = realloc(ptr, 50);
+    assert(ptr2 == ptr);
+    free(ptr2);
+    m61_trace_flush();
+
+    FILE* f = fopen(path, "rb");
+    assert(f);
+    m61_trace_header header;
+    assert(fread(&header, sizeof(header), 1, f) == 1);
+    assert(memcmp(header.magic, m61_trace_magic, sizeof(header.magic)) == 0);
+    assert(header.record_size == sizeof(m61_trace_record));
+    m61_trace_record r;
+    uint64_t last_time = 0;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        assert(r.time >= last_time);
+        last_time = r.time;
+        if (r.op == m61_trace_malloc) {
+            printf("malloc %zu %s\n", (size_t) r.size,
+                   r.ptr == (uintptr_t) ptr ? "ptr" : "?");
+        } else if (r.op == m61_trace_realloc) {
+            printf("realloc %zu %s\n", (size_t) r.size,
+                   r.ptr == r.old_ptr ? "in place" : "moved");
+        } else if (r.op == m61_trace_free) {
+            printf("free %s\n", r.ptr == (uintptr_t) ptr ? "ptr" : "?");
+        }
+    }
+    fclose(f);
+    unlink(path);
+}
+
+//! malloc 100 ptr
+//! realloc 50 in place
+//! free ptr
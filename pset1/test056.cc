@@ -0,0 +1,44 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// Fragmentation statistics: reserved bytes by size class, free slab
+// runs, metadata, and the peak active size.
+
+void* ptrs[100];
+
+int main() {
+    for (int i = 0; i != 100; ++i) {
+        ptrs[i] = malloc(20);
+    }
+    void* big = malloc(100000);
+    free(big);
+
+    m61_statistics stat;
+    m61_get_statistics(&stat);
+    assert(stat.peak_active_size == 102000);
+    assert(stat.reserved_size == stat.classes[1].reserved_size);
+    assert(stat.metadata_size > 0);
+    size_t free_before = stat.free_size;
+    size_t largest_before = stat.largest_free;
+    assert(free_before > 0 && largest_before > 0);
+
+    // freeing every other block adds free space but no longer runs
+    for (int i = 0; i != 100; i += 2) {
+        free(ptrs[i]);
+    }
+    m61_get_statistics(&stat);
+    assert(stat.free_size == free_before + 50 * stat.classes[1].size);
+    assert(stat.largest_free < largest_before + 2 * stat.classes[1].size);
+    assert(stat.peak_active_size == 102000);
+
+    m61_print_fragmentation_report();
+    for (int i = 1; i < 100; i += 2) {
+        free(ptrs[i]);
+    }
+}
+
+//! HEAP: 1000 active bytes in 50 blocks, peak 102000 bytes
+//! HEAP: 1600 reserved bytes (37.5% internal fragmentation), ??? metadata bytes
+//! HEAP: ??? free slab bytes, longest run ??? bytes (???% external fragmentation)
+//! HEAP SIZE CLASS 32: 50 active, 1000 requested bytes, 1600 reserved bytes (37.5% internal fragmentation)
@@ -0,0 +1,19 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// m61_usable_size reports a block's requested size, through reallocs.
+
+int main() {
+    void* ptr = malloc(100);
+    assert(m61_usable_size(ptr) == 100);
+    ptr = realloc(ptr, 30);
+    assert(m61_usable_size(ptr) == 30);
+    ptr = realloc(ptr, 5000);
+    assert(m61_usable_size(ptr) == 5000);
+    free(ptr);
+    m61_usable_size(ptr);
+}
+
+//! MEMORY BUG: test???.cc:15: invalid size query of pointer ??{0x\w+}??, double free
+//! ???
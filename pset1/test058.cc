@@ -0,0 +1,39 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+// m61_aligned_alloc and m61_memalign return aligned blocks of every
+// backend that are checked and reported like any other.
+
+int main() {
+    static const size_t sizes[] = {1, 100, 5000, 2 << 20};
+    for (size_t sz : sizes) {
+        for (size_t align = 32; align <= (1 << 16); align *= 2) {
+            char* ptr = (char*) m61_aligned_alloc(align, sz);
+            assert(ptr && (uintptr_t) ptr % align == 0);
+            assert(m61_usable_size(ptr) == sz);
+            memset(ptr, 'A', sz);
+            ptr = (char*) realloc(ptr, sz + 10);
+            assert(ptr[sz - 1] == 'A');
+            free(ptr);
+        }
+    }
+
+    assert(!m61_aligned_alloc(48, 10));
+    void* ptr = m61_memalign(48, 10);
+    assert((uintptr_t) ptr % 64 == 0);
+    void* big = m61_aligned_alloc(4096, 3000);
+
+    m61_statistics stat;
+    m61_get_statistics(&stat);
+    assert(stat.nactive == 2 && stat.active_size == 3010);
+    assert(stat.nfail == 1);
+    m61_print_leak_report();
+    free(ptr);
+    free(big);
+}
+
+//!!UNORDERED
+//! LEAK CHECK: test???.cc:24: allocated object ??{0x\w+}?? with size 10
+//! LEAK CHECK: test???.cc:26: allocated object ??{0x\w+}?? with size 3000
@@ -0,0 +1,14 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// Writing past the end of an aligned block is caught on free.
+
+int main() {
+    char* ptr = (char*) m61_aligned_alloc(64, 20);
+    ptr[20] = 0;
+    free(ptr);
+}
+
+//! MEMORY BUG: test???.cc:10: detected wild write during free of pointer ??{0x\w+}??
+//! ???
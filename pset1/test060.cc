@@ -0,0 +1,30 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// With M61_CACHE_ALIGN=1, small blocks start on cache lines, and blocks
+// aligned to a cache line come from the slabs.
+
+int main() {
+    // read when the allocator first initializes
+    setenv("M61_CACHE_ALIGN", "1", 1);
+    void* ptrs[40];
+    for (int i = 0; i != 40; ++i) {
+        ptrs[i] = i % 2 ? malloc(i) : m61_aligned_alloc(64, i);
+        assert((uintptr_t) ptrs[i] % 64 == 0);
+    }
+
+    m61_statistics stat;
+    m61_get_statistics(&stat);
+    assert(stat.classes[0].nactive + stat.classes[1].nactive + stat.classes[2].nactive == 40);
+    // slots are rounded up to whole cache lines
+    assert(stat.classes[0].size == 16);
+    assert(stat.classes[1].size == 80);
+    for (int i = 0; i != 40; ++i) {
+        free(ptrs[i]);
+    }
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total         40   fail          0
+//! alloc size:  active          0   total        780   fail          0
@@ -0,0 +1,21 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// With sampling, a block resized in place is sampled again as a new
+// allocation: a big block is always sampled, but after shrinking to a
+// few bytes it almost never is, and leaves the leak report.
+
+int main() {
+    // read when the allocator first initializes
+    setenv("M61_SAMPLE_RATE", "1000", 1);
+    char* shrunk = (char*) malloc(100000);
+    char* kept = (char*) malloc(100000);
+    char* moved = (char*) realloc(shrunk, 10);
+    assert(moved == shrunk);
+    printf("EXPECTED LEAK: %p\n", kept);
+    m61_print_leak_report();
+}
+
+//! EXPECTED LEAK: ??{0x\w*}=ptr??
+//! LEAK CHECK: test???.cc:13: allocated object ??ptr?? with size 100000
@@ -0,0 +1,19 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdint>
+// Wild free between a slab and a large mapped block: in the heap bounds,
+// but not in any region, so possibly unmapped.
+
+int main() {
+    char* small = (char*) malloc(10);
+    char* large = (char*) malloc(2 << 20);
+    uintptr_t between = ((uintptr_t) small / 2 + (uintptr_t) large / 2) & ~(uintptr_t) 4095;
+    fprintf(stderr, "Bad pointer %p\n", (void*) between);
+    free((void*) between);
+    m61_print_statistics();
+}
+
+//! Bad pointer ??{0x\w+}=ptr??
+//! MEMORY BUG???: invalid free of pointer ??ptr??, not allocated
+//! ???
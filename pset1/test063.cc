@@ -0,0 +1,34 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+// Arena allocators honor over-aligned types and throw when out of memory.
+
+struct alignas(256) line {
+    char c[100];
+};
+
+int main() {
+    m61_arena arena("lines", 4096);
+    {
+        std::vector<line, m61_arena_allocator<line>> small(arena), big(arena);
+        small.reserve(1);
+        big.reserve(100);
+        assert((uintptr_t) small.data() % alignof(line) == 0);
+        assert((uintptr_t) big.data() % alignof(line) == 0);
+
+        bool threw = false;
+        try {
+            small.reserve(SIZE_MAX / sizeof(line) / 2);
+        } catch (std::bad_alloc&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+    arena.release();
+    m61_print_statistics();
+}
+
+//! alloc count: active          0   total          2   fail          1
+//! ???
@@ -0,0 +1,32 @@
+#include "m61.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// Stacks of calloc'd and realloc'd blocks start at their caller, not
+// inside m61.
+
+extern "C" __attribute__((noinline)) void* zeroed(size_t sz) {
+    void* ptr = calloc(1, sz);
+    asm volatile("" : : "r" (ptr) : "memory");   // not a tail call
+    return ptr;
+}
+
+extern "C" __attribute__((noinline)) void* grown(void* ptr, size_t sz) {
+    ptr = realloc(ptr, sz);
+    asm volatile("" : : "r" (ptr) : "memory");
+    return ptr;
+}
+
+int main() {
+    setenv("M61_STACK_DEPTH", "1", 1);
+    (void) zeroed(100);
+    // moves to a bigger slab slot
+    (void) grown(malloc(10), 1000);
+    m61_print_leak_report();
+}
+
+//!!UNORDERED
+//! LEAK CHECK: test???.cc:9: allocated object ??{0x\w+}?? with size 100
+//!    #0 0x??? zeroed+0x???
+//! LEAK CHECK: test???.cc:15: allocated object ??{0x\w+}?? with size 1000
+//!    #0 0x??? grown+0x???
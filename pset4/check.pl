@@ -922,6 +922,44 @@ enqueue(31,
     "redirected large file, 1B-4KB block I/O, sequential");
 
 
+
+# KERNEL COPIES (io61_copy)
+
+enqueue(32,
+    "./copycat61 -o files/out.txt files/text20meg.txt",
+    "regular large file, whole-file copy, sequential");
+
+enqueue(33,
+    "./copycat61 -b 4096 -o files/out.txt files/text20meg.txt",
+    "regular large file, 4KB block copy, sequential");
+
+enqueue(34,
+    "cat files/text20meg.txt | ./copycat61 | cat > files/out.txt",
+    "piped large file, whole-file copy, sequential");
+
+enqueue(35,
+    "./copycat61 files/text20meg.txt | cat > files/out.txt",
+    "mixed-piped large file, whole-file copy, sequential");
+
+enqueue(36,
+    "./copycat61 -s 5242880 -o files/out.txt /dev/zero",
+    "magic zero file, whole-file copy, sequential",
+    "insize" => 5242880);
+
+
+# SEEKS PAST END OF FILE
+
+enqueue(37,
+    "./reverse61 -s 200000 -o files/out.txt files/text90k-rev.txt",
+    "regular small file read past its end, character I/O, reverse order",
+    "insize" => 200000);
+
+enqueue(38,
+    "./reverse61 -s 3145728 -o files/out.txt files/text1meg.txt",
+    "regular small file read past its end, character I/O, reverse order",
+    "insize" => 3145728);
+
+
 run($sequentially);
 
 summary();
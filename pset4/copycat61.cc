@@ -0,0 +1,29 @@
+#include "io61.hh"
+
+// Usage: ./copycat61 [-b BLOCKSIZE] [-s SIZE] [-o OUTFILE] [FILE]
+//    Copies the input FILE to OUTFILE with io61_copy, BLOCKSIZE
+//    characters per call. By default one call copies the whole file.
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_arguments args(argc, argv, "b:s:o:i:");
+    size_t block_size = args.block_size ? args.block_size : args.input_size;
+
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Copy file data
+    while (args.input_size > 0) {
+        ssize_t amount = io61_copy(inf, outf, std::min(block_size, args.input_size));
+        if (amount <= 0) {
+            break;
+        }
+        args.input_size -= amount;
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}
@@ -1,11 +1,16 @@
 #include "io61.hh"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <climits>
 #include <cerrno>
 #include <algorithm>
 
 #define CACHESIZE 16392
+#define WINDOWSIZE (1 << 20)
+#define NLANES 8
+#define LANESIZE (CACHESIZE / NLANES)
 
 // io61.c
 //    YOUR CODE HERE!
@@ -17,13 +22,28 @@
 struct io61_file {
     int fd; // file descriptor used for systemcalls
     int mode;
+    mode_t type;    // file type bits of st_mode (S_IFREG, S_IFIFO, ...)
     char cache[CACHESIZE]; // cache for file
-    off_t tag;      // file offset of first byte in cache (0 when file is opened)
-    off_t end_tag;  // file offset one past last valid byte in cache
-    off_t pos_tag;  // file offset of next char to read in cache
+    char* buf;      // data read from: `cache`, or `map` for mapped files
+    char* map;      // mapping of the whole file (read mode), or nullptr
+    off_t size;     // size of the mapping
+    bool seq;       // mapping is advised MADV_SEQUENTIAL
+    off_t back_tag; // mapped: readahead covers [back_tag, end_tag)
+    off_t seek_tag; // unmapped: file offset of the last io61_seek
+    off_t seek_stride;  // unmapped: distance between the last two seeks
+    int lane;       // strided reads: lane of the cache in use, or -1
+    off_t lane_tag[NLANES];     // each lane's tag and end_tag (the lane
+    off_t lane_end_tag[NLANES]; // in use keeps them in tag and end_tag)
+    off_t tag;      // file offset of first byte in buf (0 when file is opened)
+    off_t end_tag;  // file offset one past last valid byte in buf
+    off_t pos_tag;  // file offset of next char to read in buf
 };
 
 int io61_fill(io61_file* f);
+static void io61_map(io61_file* f);
+static void io61_map_back(io61_file* f, off_t pos);
+static ssize_t io61_splice(io61_file* in, io61_file* out, size_t sz);
+static int io61_seek_lane(io61_file* f, off_t pos);
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file for file descriptor `fd`. `mode` is
@@ -36,27 +56,122 @@ io61_file* io61_fdopen(int fd, int mode) {
     io61_file* f = new io61_file;
     f->fd = fd;
     f->mode = mode;
-    f->end_tag = 0;
+    struct stat s;
+    f->type = fstat(fd, &s) == 0 ? s.st_mode & S_IFMT : 0;
+    f->buf = f->cache;
+    f->map = nullptr;
+    f->tag = f->pos_tag = f->end_tag = 0;
+    f->back_tag = f->seek_tag = f->seek_stride = 0;
+    f->lane = -1;
+    if (mode == O_RDONLY)
+    {
+        io61_map(f);
+    }
 
     return f;
 }
 
 
+// io61_map(f)
+//    Map all of `f` if it is a regular file, so reads copy straight from
+//    the page cache instead of calling read(). The mapping is the whole
+//    buffer (tag stays 0), so any seek within it is free; end_tag only
+//    marks how far readahead has gone, and io61_fill extends it a window
+//    at a time. Pipes, devices and other files that cannot be mapped stay
+//    buffered.
+
+static void io61_map(io61_file* f) {
+    off_t size = io61_filesize(f);
+    off_t pos = lseek(f->fd, 0, SEEK_CUR);
+    if (size <= 0 || pos < 0)
+    {
+        return;
+    }
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    f->seq = true;
+    f->buf = f->map = (char*) map;
+    f->size = size;
+    // start where the file descriptor was
+    f->pos_tag = f->end_tag = pos;
+    f->back_tag = pos & ~(off_t) (sysconf(_SC_PAGESIZE) - 1);
+}
+
+
+// io61_map_back(f, pos)
+//    Read ahead backward in mapped file `f`, which is moving to `pos`
+//    below what was read ahead: ask for the two windows that end at
+//    `pos` and map in the nearer one. The kernel reads ahead of faults
+//    in a sequential mapping only forward, so that advice is dropped.
+
+static void io61_map_back(io61_file* f, off_t pos) {
+    if (f->seq)
+    {
+        madvise(f->map, f->size, MADV_NORMAL);
+        f->seq = false;
+    }
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t end = std::min(f->size, (pos + page) & ~(page - 1));
+    off_t start = std::max((off_t) 0, end - WINDOWSIZE);
+    off_t ahead = std::max((off_t) 0, start - WINDOWSIZE);
+    madvise(f->map + ahead, end - ahead, MADV_WILLNEED);
+#ifdef MADV_POPULATE_READ
+    madvise(f->map + start, end - start, MADV_POPULATE_READ);
+#endif
+    f->back_tag = start;
+}
+
+
 // io61_close(f)
 //    Close the io61_file `f` and release all its resources.
 
 int io61_close(io61_file* f) {
     io61_flush(f);
+    if (f->map)
+    {
+        munmap(f->map, f->size);
+    }
     int r = close(f->fd);
     delete f;
     return r;
 }
 
 int io61_fill(io61_file* f) {
+    if (f->map)
+    {
+        // extend the window over the mapping (nothing past the end means
+        // end of file): ask the kernel to read it and the next window
+        // ahead, then map its pages in one call rather than one fault each
+        if (f->end_tag >= f->size)
+        {
+            return 0;
+        }
+        off_t start = f->end_tag & ~(off_t) (sysconf(_SC_PAGESIZE) - 1);
+        f->end_tag = std::min(f->size, f->end_tag + WINDOWSIZE);
+        madvise(f->map + start, std::min(f->size - start, (off_t) 2 * WINDOWSIZE), MADV_WILLNEED);
+#ifdef MADV_POPULATE_READ
+        madvise(f->map + start, f->end_tag - start, MADV_POPULATE_READ);
+#endif
+        return 0;
+    }
+
     // advance tag, pos_tag to previous end_tag
     f->tag = f->pos_tag = f->end_tag;
 
-    ssize_t nread = read(f->fd, f->cache, CACHESIZE);
+    // a lane reads where its window ends; the file offset is unused
+    ssize_t nread;
+    if (f->lane >= 0)
+    {
+        nread = pread(f->fd, f->buf, LANESIZE, f->tag);
+    }
+    else
+    {
+        nread = read(f->fd, f->cache, CACHESIZE);
+    }
     if (nread >= 0)
     {
         // update end_tag
@@ -86,7 +201,7 @@ int io61_readc(io61_file* f) {
         }
     }
 
-    unsigned char c = f->cache[f->pos_tag - f->tag];
+    unsigned char c = f->buf[f->pos_tag - f->tag];
     ++f->pos_tag;
     return c;
 }
@@ -119,7 +234,7 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
         }
 
         size_t n_tocopy = std::min(n_toread, (size_t) f->end_tag - f->pos_tag);
-        memcpy(&buf[nread], &f->cache[f->pos_tag - f->tag], n_tocopy);
+        memcpy(&buf[nread], &f->buf[f->pos_tag - f->tag], n_tocopy);
         f->pos_tag += n_tocopy;
         nread += n_tocopy;
         n_toread -= n_tocopy;
@@ -179,19 +294,162 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_copy(in, out, sz)
+//    Copy up to `sz` characters from `in` to `out`. Returns the number of
+//    characters copied on success; normally this is `sz`. Returns a short
+//    count, which might be zero, if `in` ended before `sz` characters
+//    could be copied. Returns -1 if an error occurred before any
+//    characters were copied.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t sz) {
+    assert(in->mode == O_RDONLY && out->mode == O_WRONLY);
+    size_t ncopied = 0;
+
+    // data `in` has already read goes first (a mapped file has nothing
+    // the kernel can't copy again itself)
+    if (!in->map && in->pos_tag < in->end_tag)
+    {
+        size_t n = std::min(sz, (size_t) (in->end_tag - in->pos_tag));
+        if (io61_write(out, &in->buf[in->pos_tag - in->tag], n) == -1)
+        {
+            return -1;
+        }
+        in->pos_tag += n;
+        ncopied += n;
+    }
+    if (ncopied == sz)
+    {
+        return ncopied;
+    }
+
+    // the kernel writes at `out`'s file offset, so empty its cache
+    // first; `in` reads from its own, which lanes leave behind
+    if (io61_flush(out) == -1
+        || (in->lane >= 0 && lseek(in->fd, in->end_tag, SEEK_SET) == -1))
+    {
+        return ncopied ? ncopied : -1;
+    }
+    while (ncopied < sz)
+    {
+        ssize_t n = io61_splice(in, out, sz - ncopied);
+        if (n <= 0)
+        {
+            if (n == 0)
+            {
+                // end of file
+                return ncopied;
+            }
+            break;
+        }
+        ncopied += n;
+    }
+
+    // no kernel copy for these files: read straight into `out`'s cache
+    while (ncopied < sz)
+    {
+        if (out->pos_tag == out->end_tag && io61_flush(out) == -1)
+        {
+            break;
+        }
+        char* dst = &out->cache[out->pos_tag - out->tag];
+        size_t n_toread = std::min(sz - ncopied, (size_t) (out->end_tag - out->pos_tag));
+        ssize_t nread;
+        if (in->map)
+        {
+            nread = io61_read(in, dst, n_toread);
+        }
+        else
+        {
+            // `in`'s cache is empty and stays empty
+            nread = read(in->fd, dst, n_toread);
+            if (nread > 0)
+            {
+                in->tag = in->pos_tag = in->end_tag += nread;
+            }
+        }
+        if (nread <= 0)
+        {
+            if (nread == -1 && ncopied == 0)
+            {
+                return -1;
+            }
+            break;
+        }
+        out->pos_tag += nread;
+        ncopied += nread;
+    }
+
+    return ncopied;
+}
+
+
+// io61_splice(in, out, sz)
+//    Move up to `sz` characters from `in`'s file to `out`'s without
+//    copying them through user space: copy_file_range between regular
+//    files, sendfile from a regular file to anything, splice to or from a
+//    pipe. `out`'s cache must be empty. Returns the number moved, 0 at end
+//    of file, or -1 if the kernel cannot move data between these files.
+
+static ssize_t io61_splice(io61_file* in, io61_file* out, size_t sz) {
+    // a mapped file never moves its file offset, so copy from pos_tag
+    off_t in_off = in->pos_tag;
+    off_t* in_offp = in->map ? &in_off : nullptr;
+    // the kernel rejects counts that would overflow the file offset, and
+    // moves less than 2GB per call anyway
+    sz = std::min(sz, (size_t) 1 << 30);
+
+    ssize_t n = -1;
+    if (S_ISREG(in->type) && S_ISREG(out->type))
+    {
+        n = copy_file_range(in->fd, in_offp, out->fd, nullptr, sz, 0);
+    }
+    if (n == -1 && S_ISREG(in->type))
+    {
+        n = sendfile(out->fd, in->fd, in_offp, sz);
+    }
+    if (n == -1 && (S_ISFIFO(in->type) || S_ISFIFO(out->type)))
+    {
+        n = splice(in->fd, in_offp, out->fd, nullptr, sz, SPLICE_F_MOVE);
+    }
+    if (n <= 0)
+    {
+        return n;
+    }
+
+    in->pos_tag += n;
+    if (in->map)
+    {
+        in->end_tag = std::max(in->end_tag, in->pos_tag);
+    }
+    else
+    {
+        // the file offset moved past an empty cache
+        in->tag = in->end_tag = in->pos_tag;
+    }
+    out->tag = out->pos_tag += n;
+    out->end_tag = out->tag + CACHESIZE;
+    return n;
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
 //    data buffered for reading, or do nothing.
 
 int io61_flush(io61_file* f) {
+    if (f->mode == O_RDONLY)
+    {
+        return 0;
+    }
     // write from tag -> pos_tag
     int nwritten = write(f->fd, f->cache, f->pos_tag - f->tag);
     if (nwritten >= 0)
     {
-        // update tags
+        // update tags; the whole cache is free again even if this
+        // flush came before it filled
         f->tag = f->pos_tag;
-        f->end_tag += CACHESIZE;
+        f->end_tag = f->tag + CACHESIZE;
         return 0;
     }
     return -1;
@@ -205,22 +463,97 @@ int io61_flush(io61_file* f) {
 int io61_seek(io61_file* f, off_t pos) {
     if (f->mode == O_RDONLY)
     {
-        int offset = pos % CACHESIZE;
+        if (f->map)
+        {
+            // all of the file is mapped: seeks within what was read ahead
+            // are free, seeks below it read ahead backward, and seeks past
+            // it restart readahead from `pos`. past the end of file, reads
+            // return EOF, so no tag may pass f->size
+            pos = std::min(pos, f->size);
+            if (pos >= f->back_tag && pos < f->end_tag)
+            {
+                f->pos_tag = pos;
+                return 0;
+            }
+            else if (pos < 0)
+            {
+                return -1;
+            }
+            if (pos < f->back_tag)
+            {
+                io61_map_back(f, pos);
+            }
+            if (pos >= f->end_tag)
+            {
+                f->end_tag = pos;
+                f->back_tag = pos & ~(off_t) (sysconf(_SC_PAGESIZE) - 1);
+            }
+            f->pos_tag = pos;
+            return 0;
+        }
+
+        // the distance from the last seek tells which way reads are going
+        off_t stride = pos - f->seek_tag;
+        bool repeated = stride == f->seek_stride;
+        f->seek_tag = pos;
+        f->seek_stride = stride;
+
         if (pos >= f->tag && pos < f->end_tag)
         {
             f->pos_tag = pos;
             return 0;
         }
+        else if (pos < 0)
+        {
+            return -1;
+        }
 
-        off_t new_tag = lseek(f->fd, pos - offset, SEEK_SET);
-        if (new_tag == -1)
+        // a stride that repeats and is too long for one window to serve
+        // two seeks splits the cache into lanes, one window per stream;
+        // the first lane keeps the start of the current window
+        if (f->lane < 0 && repeated && std::abs(stride) >= LANESIZE)
+        {
+            for (int i = 0; i != NLANES; ++i)
+            {
+                f->lane_tag[i] = f->lane_end_tag[i] = 0;
+            }
+            f->lane = 0;
+            f->end_tag = std::min(f->end_tag, f->tag + LANESIZE);
+        }
+        else if (f->lane >= 0 && std::abs(stride) < LANESIZE)
+        {
+            // back to one window, refilled below
+            f->lane = -1;
+            f->buf = f->cache;
+        }
+        if (f->lane >= 0)
+        {
+            return io61_seek_lane(f, pos);
+        }
+
+        // place the new window by the direction of travel: reading
+        // backward, it ends just past `pos` (far enough for a read of
+        // `stride` bytes), so the next seeks land inside it; otherwise it
+        // starts at `pos`
+        off_t new_tag = pos;
+        if (stride < 0 && -stride < CACHESIZE)
+        {
+            new_tag = std::max((off_t) 0, pos - stride - CACHESIZE);
+        }
+        // devices like /dev/zero return 0 from any lseek, so keep track
+        // of the offset asked for rather than the one returned
+        if (lseek(f->fd, new_tag, SEEK_SET) == -1)
         {
             return -1;
         }
 
         f->end_tag = new_tag;
-        io61_fill(f);
-        f->pos_tag += offset;
+        if (io61_fill(f) == -1)
+        {
+            return -1;
+        }
+        // past the end of file, reads return EOF
+        f->pos_tag = std::min(pos, f->end_tag);
 
         return 0;
     }
@@ -242,6 +575,65 @@ int io61_seek(io61_file* f, off_t pos) {
 }
 
 
+// io61_seek_lane(f, pos)
+//    Seek `f`, whose cache is split into lanes, to `pos`. Switches to the
+//    lane whose window holds `pos` if there is one. Otherwise refills the
+//    lane of the stream `pos` continues (a window ending just before
+//    `pos`, or starting just after it, which is then filled backward),
+//    or else the next lane round robin. Returns 0 on success and -1 on
+//    failure.
+
+static int io61_seek_lane(io61_file* f, off_t pos) {
+    f->lane_tag[f->lane] = f->tag;
+    f->lane_end_tag[f->lane] = f->end_tag;
+
+    int next = (f->lane + 1) % NLANES;
+    bool backward = false;
+    for (int i = 0; i != NLANES; ++i)
+    {
+        off_t tag = f->lane_tag[i];
+        off_t end_tag = f->lane_end_tag[i];
+        if (pos >= tag && pos < end_tag)
+        {
+            f->lane = i;
+            f->buf = &f->cache[i * LANESIZE];
+            f->tag = tag;
+            f->end_tag = end_tag;
+            f->pos_tag = pos;
+            return 0;
+        }
+        else if (pos >= end_tag && pos - end_tag < LANESIZE)
+        {
+            next = i;
+            backward = false;
+        }
+        else if (pos < tag && tag - pos <= LANESIZE)
+        {
+            next = i;
+            backward = true;
+        }
+    }
+
+    off_t new_tag = pos;
+    if (backward)
+    {
+        new_tag = std::max((off_t) 0, f->lane_tag[next] - LANESIZE);
+    }
+    f->lane = next;
+    f->buf = &f->cache[next * LANESIZE];
+    ssize_t nread = pread(f->fd, f->buf, LANESIZE, new_tag);
+    if (nread == -1)
+    {
+        f->tag = f->pos_tag = f->end_tag = pos;
+        return -1;
+    }
+    f->tag = new_tag;
+    f->end_tag = new_tag + nread;
+    f->pos_tag = std::min(pos, f->end_tag);
+    return 0;
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -23,6 +23,7 @@ int io61_writec(io61_file* f, int ch);
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz);
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t sz);
 
 int io61_flush(io61_file* f);
 
@@ -117,6 +117,26 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_copy(in, out, sz)
+//    Copy up to `sz` characters from `in` to `out`. Returns the number of
+//    characters copied on success; normally this is `sz`. Returns a short
+//    count, which might be zero, if `in` ended before `sz` characters
+//    could be copied. Returns -1 if an error occurred before any
+//    characters were copied.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t sz) {
+    size_t ncopied = 0;
+    while (ncopied != sz) {
+        int ch = io61_readc(in);
+        if (ch == EOF || io61_writec(out, ch) == -1) {
+            break;
+        }
+        ++ncopied;
+    }
+    return ncopied;
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <climits>
 #include <cerrno>
+#include <algorithm>
 
 // stdio-io61.c
 //    This version of io61.c is a simple wrapper on stdio. Can you beat it?
@@ -90,6 +91,31 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_copy(in, out, sz)
+//    Copy up to `sz` characters from `in` to `out`. Returns the number of
+//    characters copied on success; normally this is `sz`. Returns a short
+//    count, which might be zero, if `in` ended before `sz` characters
+//    could be copied. Returns -1 if an error occurred before any
+//    characters were copied.
+
+ssize_t io61_copy(io61_file* in, io61_file* out, size_t sz) {
+    char buf[BUFSIZ];
+    size_t ncopied = 0;
+    while (ncopied != sz) {
+        size_t n = fread(buf, 1, std::min(sz - ncopied, sizeof(buf)), in->f);
+        if (n == 0 || fwrite(buf, 1, n, out->f) != n) {
+            break;
+        }
+        ncopied += n;
+    }
+    if (ncopied != 0 || sz == 0 || !(ferror(in->f) || ferror(out->f))) {
+        return (ssize_t) ncopied;
+    } else {
+        return (ssize_t) -1;
+    }
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all